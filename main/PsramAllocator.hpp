@@ -1,18 +1,99 @@
 #pragma once
 
+#include <cstring>
 #include <esp_heap_caps.h>
 #include "ArduinoJson.hpp"
 
-struct SpiRamAllocator : ArduinoJson::Allocator {
+// Bump allocator over one PSRAM region. Frees are no-ops except for the newest block,
+// everything goes at once with reset(), so reloading a document costs no heap calls.
+struct SpiRamArena : ArduinoJson::Allocator {
+    ~SpiRamArena() {
+        heap_caps_free(base);
+    }
+
+    // Drops all allocations, the region is only replaced when it's smaller than min_size
+    bool reset(size_t min_size) {
+        used = 0;
+        last = nullptr;
+        if (base != nullptr && capacity >= min_size) {
+            return true;
+        }
+
+        heap_caps_free(base);
+        capacity = 0;
+        base = (uint8_t *)heap_caps_malloc(min_size, MALLOC_CAP_SPIRAM);
+        if (base == nullptr) {
+            return false;
+        }
+
+        capacity = min_size;
+        return true;
+    }
+
     void* allocate(size_t size) override {
-        return heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+        size_t total = HDR_SIZE + align(size);
+        if (base == nullptr || total > capacity - used) {
+            return nullptr;
+        }
+
+        uint8_t *block = base + used;
+        *(size_t *)block = size;
+        used += total;
+        peak = used > peak ? used : peak;
+        last = block + HDR_SIZE;
+        return last;
     }
 
     void deallocate(void* pointer) override {
-        heap_caps_free(pointer);
+        // Only the newest block can be given back, ArduinoJson frees its pools in reverse order anyway
+        if (pointer != nullptr && pointer == last) {
+            used = (uint8_t *)pointer - HDR_SIZE - base;
+            last = nullptr;
+        }
     }
 
     void* reallocate(void* ptr, size_t new_size) override {
-        return heap_caps_realloc(ptr, new_size, MALLOC_CAP_SPIRAM);
+        if (ptr == nullptr) {
+            return allocate(new_size);
+        }
+
+        size_t old_size = *(size_t *)((uint8_t *)ptr - HDR_SIZE);
+        if (ptr == last) {
+            // Newest block grows or shrinks in place
+            size_t start = (uint8_t *)ptr - base;
+            if (align(new_size) > capacity - start) {
+                return nullptr;
+            }
+
+            *(size_t *)((uint8_t *)ptr - HDR_SIZE) = new_size;
+            used = start + align(new_size);
+            peak = used > peak ? used : peak;
+            return ptr;
+        }
+
+        if (new_size <= old_size) {
+            return ptr;
+        }
+
+        void *moved = allocate(new_size);
+        if (moved != nullptr) {
+            memcpy(moved, ptr, old_size);
+        }
+
+        return moved;
     }
-};
\ No newline at end of file
+
+    size_t get_capacity() const { return capacity; }
+    size_t get_used() const { return used; }
+    size_t get_peak() const { return peak; }
+
+private:
+    static constexpr size_t align(size_t size) { return (size + 7) & ~(size_t)7; }
+    static const constexpr size_t HDR_SIZE = 8; // Block size, kept so a moved block knows what to copy
+
+    uint8_t *base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t peak = 0;
+    void *last = nullptr;
+};
@@ -0,0 +1,113 @@
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_app_desc.h>
+#include "boot_timing.hpp"
+#include "sdmmc_manager.hpp"
+
+void boot_timing::begin(boot_phase phase)
+{
+    start_us[phase] = esp_timer_get_time();
+}
+
+void boot_timing::end(boot_phase phase)
+{
+    end_us[phase] = esp_timer_get_time();
+}
+
+void boot_timing::finish()
+{
+    // esp_timer starts before app_main, so this is close to time since reset minus the bootloader
+    ready_us = esp_timer_get_time();
+    for (size_t idx = 0; idx < BOOT_PHASE_MAX; idx++) {
+        if (end_us[idx] > 0) {
+            ESP_LOGI(TAG, "%-14s %7lld .. %7lld us (%lld us)", PHASE_NAMES[idx], start_us[idx], end_us[idx], end_us[idx] - start_us[idx]);
+        }
+    }
+
+    ESP_LOGI(TAG, "Logging from %lld us after reset", ready_us);
+}
+
+esp_err_t boot_timing::write_record(uint32_t boot_id, const char *path)
+{
+    // One line per boot: start and duration of each phase, so overlap shows up as well as length
+    char header[HEADER_MAX_LEN] = {};
+    size_t header_len = snprintf(header, sizeof(header), "boot_id,fw_version,ready_us");
+    for (auto *name : PHASE_NAMES) {
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, ",%s_start_us,%s_us", name, name);
+    }
+
+    snprintf(header + header_len, sizeof(header) - header_len, "\n");
+
+    struct stat st = {};
+    bool new_file = stat(path, &st) != 0 || st.st_size == 0;
+    if (!new_file && !header_matches(path, header)) {
+        esp_err_t ret = rotate(path);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        new_file = true;
+        st.st_size = 0;
+    }
+
+    FILE *file = fopen(path, "a");
+    if (file == nullptr) {
+        ESP_LOGW(TAG, "Can't open %s, errno %d", path, errno);
+        return ESP_FAIL;
+    }
+
+    // Free space is charged by what fprintf says it appended
+    int len = 0;
+    if (new_file) {
+        len += fprintf(file, "%s", header);
+    }
+
+    len += fprintf(file, "%08lX,%s,%lld", boot_id, esp_app_get_description()->version, ready_us);
+    for (size_t idx = 0; idx < BOOT_PHASE_MAX; idx++) {
+        len += fprintf(file, ",%lld,%lld", start_us[idx], end_us[idx] - start_us[idx]);
+    }
+
+    len += fprintf(file, "\n");
+    if (len > 0) {
+        sdmmc_manager::instance()->charge_write(st.st_size, len);
+    }
+
+    return fclose(file) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+bool boot_timing::header_matches(const char *path, const char *header)
+{
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) {
+        return false;
+    }
+
+    char line[HEADER_MAX_LEN] = {};
+    bool match = fgets(line, sizeof(line), file) != nullptr && strcmp(line, header) == 0;
+    fclose(file);
+    return match;
+}
+
+esp_err_t boot_timing::rotate(const char *path)
+{
+    // The phases changed since the file was started, so its rows move to .old under the header they were written with
+    char old_path[64] = {};
+    snprintf(old_path, sizeof(old_path), "%s.old", path);
+    struct stat st = {};
+    if (stat(old_path, &st) == 0 && unlink(old_path) == 0) {
+        sdmmc_manager::instance()->release_space(st.st_size);
+    }
+
+    if (rename(path, old_path) != 0) {
+        ESP_LOGW(TAG, "Can't move %s aside for a new header, errno %d", path, errno);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Phases changed, previous timings kept in %s", old_path);
+    return ESP_OK;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <esp_err.h>
+
+enum boot_phase : uint8_t
+{
+    BOOT_PHASE_NVS = 0, // Boot count and last-known config
+    BOOT_PHASE_EARLY_CAPTURE, // Driver install and ring allocation on the last-known config
+    BOOT_PHASE_CARD_INIT, // Card init and mount, runs alongside the two above
+    BOOT_PHASE_RECOVERY, // Journal replay of segments torn by the last power cut
+    BOOT_PHASE_CONFIG,
+    BOOT_PHASE_RETENTION,
+    BOOT_PHASE_CHANNELS, // First segments and config reconciliation
+    BOOT_PHASE_MAX,
+};
+
+// Start and end of each startup phase on the esp_timer clock, appended to a CSV on the card once per boot
+// so boot latency can be compared across firmware versions. Phases may overlap, each is only touched by one task.
+class boot_timing
+{
+public:
+    static boot_timing *instance()
+    {
+        static boot_timing _instance;
+        return &_instance;
+    }
+
+    boot_timing(boot_timing const &) = delete;
+    void operator=(boot_timing const &) = delete;
+
+private:
+    boot_timing() = default;
+
+public:
+    void begin(boot_phase phase);
+    void end(boot_phase phase);
+    void finish();
+    esp_err_t write_record(uint32_t boot_id, const char *path = "/sdcard/boot_timing.csv");
+
+private:
+    static bool header_matches(const char *path, const char *header);
+    static esp_err_t rotate(const char *path);
+
+private:
+    int64_t start_us[BOOT_PHASE_MAX] = {};
+    int64_t end_us[BOOT_PHASE_MAX] = {};
+    int64_t ready_us = 0;
+
+private:
+    static const constexpr char *PHASE_NAMES[BOOT_PHASE_MAX] = { "nvs", "early_capture", "card_init", "recovery", "config", "retention", "channels" };
+    static const constexpr char TAG[] = "boot_timing";
+    static const constexpr size_t HEADER_MAX_LEN = 320; // Room for about 12 phases
+};
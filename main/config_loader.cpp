@@ -1,172 +1,825 @@
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <nvs.h>
+#include <freertos/task.h>
+#include <soc/uart_reg.h>
 #include "config_loader.hpp"
+#include "sdmmc_manager.hpp"
+
+// ArduinoJson custom reader over a FILE*, refilled from the caller's buffer.
+// Keeps a CRC of everything it reads, for the cache body.
+class json_file_reader
+{
+public:
+    json_file_reader(FILE *_fp, char *_buf, size_t _buf_len) : fp(_fp), buf(_buf), buf_len(_buf_len) {}
+
+    int read()
+    {
+        if (pos == len && !fill()) {
+            return -1;
+        }
+
+        return (uint8_t)buf[pos++];
+    }
+
+    size_t readBytes(char *out, size_t out_len)
+    {
+        size_t copied = 0;
+        while (copied < out_len && (pos < len || fill())) {
+            size_t chunk = len - pos < out_len - copied ? len - pos : out_len - copied;
+            memcpy(out + copied, buf + pos, chunk);
+            pos += chunk;
+            copied += chunk;
+        }
+
+        return copied;
+    }
+
+    // Reads whatever the parser left, so crc and total cover the whole file
+    void finish()
+    {
+        while (fill()) {
+        }
+    }
+
+    uint32_t get_crc() const { return crc; }
+    size_t get_total() const { return total; }
+
+private:
+    bool fill()
+    {
+        len = fread(buf, 1, buf_len, fp);
+        pos = 0;
+        crc = esp_rom_crc32_le(crc, (const uint8_t *)buf, len);
+        total += len;
+        return len > 0;
+    }
+
+private:
+    FILE *fp;
+    char *buf;
+    size_t buf_len;
+    size_t pos = 0;
+    size_t len = 0;
+    uint32_t crc = 0;
+    size_t total = 0;
+};
+
+// ArduinoJson custom writer into a FILE*, with a CRC of what went out
+class json_file_writer
+{
+public:
+    explicit json_file_writer(FILE *_fp) : fp(_fp) {}
+
+    size_t write(uint8_t val)
+    {
+        return write(&val, 1);
+    }
+
+    size_t write(const uint8_t *buf, size_t len)
+    {
+        size_t written = fwrite(buf, 1, len, fp);
+        crc = esp_rom_crc32_le(crc, buf, written);
+        total += written;
+        return written;
+    }
+
+    uint32_t get_crc() const { return crc; }
+    size_t get_total() const { return total; }
+
+private:
+    FILE *fp;
+    uint32_t crc = 0;
+    size_t total = 0;
+};
 
 esp_err_t config_loader::get_uart_cfg(uart_port_t port, gpio_num_t &tx, gpio_num_t &rx, gpio_num_t &rts, gpio_num_t &cts, uart_config_t *cfg_out)
 {
-    if (!config_doc["uart"].is<JsonArray>()) {
-        ESP_LOGE(TAG, "\'uart\' object isn't array");
+    if (port < 0 || port >= UART_NUM_MAX || !model.ports[port].present) {
+        ESP_LOGE(TAG, "No config for UART port %lu", (uint32_t)port);
         return ESP_ERR_INVALID_STATE;
     }
 
-    auto cfg_array = config_doc["uart"].as<JsonArray>();
-    if (cfg_array.size() == 0) {
-        ESP_LOGE(TAG, "\'uart\' array is empty");
-        return ESP_ERR_INVALID_STATE;
+    const port_cfg &cfg = model.ports[port];
+    if (cfg.status != ESP_OK) {
+        return cfg.status;
+    }
+
+    tx = cfg.tx;
+    rx = cfg.rx;
+    rts = cfg.rts;
+    cts = cfg.cts;
+    if (cfg_out != nullptr) {
+        *cfg_out = cfg.uart;
     }
 
-    if (cfg_array[(uint32_t)port].isNull() || !cfg_array[(uint32_t)port].is<JsonObject>()) {
+    return ESP_OK;
+}
+
+esp_err_t config_loader::get_sink_cfg(uart_port_t port, bool &compress, uint64_t &quota_bytes)
+{
+    compress = false;
+    quota_bytes = 0;
+    if (port < 0 || port >= UART_NUM_MAX || !model.ports[port].present) {
         ESP_LOGE(TAG, "Invalid config for UART port %lu", (uint32_t)port);
         return ESP_ERR_INVALID_STATE;
     }
 
-    auto cfg_obj = cfg_array[(int)port].as<JsonObject>();
-    int32_t tx_pin = cfg_obj["tx_pin"];
-    int32_t rx_pin = cfg_obj["rx_pin"];
-    int32_t cts_pin = cfg_obj["cts_pin"];
-    int32_t rts_pin = cfg_obj["rts_pin"];
+    compress = model.ports[port].compress;
+    quota_bytes = model.ports[port].quota_bytes;
+    return ESP_OK;
+}
+
+esp_err_t config_loader::get_retention_cfg(uint64_t &reserve_bytes, uint64_t &segment_bytes)
+{
+    reserve_bytes = model.reserve_bytes;
+    segment_bytes = model.segment_bytes;
+    return ESP_OK;
+}
+
+esp_err_t config_loader::get_merge_cfg(bool &enable, uint32_t &window_ms, bool &compress, uint64_t &quota_bytes)
+{
+    enable = model.merge_enable;
+    window_ms = model.merge_window_ms;
+    compress = model.merge_compress;
+    quota_bytes = model.merge_quota_bytes;
+    return ESP_OK;
+}
+
+esp_err_t config_loader::get_sniffer_cfg(bool &enable, uint8_t &idle_symbols)
+{
+    enable = model.sniffer_enable;
+    idle_symbols = model.sniffer_idle_symbols;
+    return ESP_OK;
+}
+
+esp_err_t config_loader::get_tail_cfg(bool &enable, bus_policy &policy)
+{
+    enable = model.tail_enable;
+    policy = model.tail_policy;
+    return ESP_OK;
+}
+
+void config_loader::build_model()
+{
+    // The one pass over the document, every field is checked here and nowhere else
+    prev_model = model;
+    model = {};
+    model.reserve_bytes = (uint64_t)DEFAULT_RESERVE_MB * 1024 * 1024;
+    model.segment_bytes = (uint64_t)DEFAULT_SEGMENT_MB * 1024 * 1024;
+    model.merge_window_ms = DEFAULT_MERGE_WINDOW_MS;
+    model.sniffer_idle_symbols = DEFAULT_SNIFFER_IDLE_SYMBOLS;
+    model.tail_policy = BUS_POLICY_DROP; // A slow console shouldn't hold up the card
 
-    if (tx_pin > GPIO_NUM_MAX || tx_pin < 0) {
-        tx = GPIO_NUM_NC;
+    // A broken entry leaves a port that's running as it was, a typo in a live edit shouldn't take it down
+    if (!docs[live_doc]["uart"].is<JsonArray>()) {
+        ESP_LOGE(TAG, "\'uart\' object isn't array, ports keep their previous settings");
+        for (size_t port = 0; port < UART_NUM_MAX; port++) {
+            model.ports[port] = prev_model.ports[port];
+        }
     } else {
-        tx = (gpio_num_t)tx_pin;
+        auto port_array = docs[live_doc]["uart"].as<JsonArray>();
+        for (size_t port = 0; port < UART_NUM_MAX && port < port_array.size(); port++) {
+            // {} is a placeholder for a port we don't capture from, e.g. the console
+            if (port_array[port].is<JsonObject>() && port_array[port].size() > 0) {
+                build_port(port, port_array[port].as<JsonObject>(), model.ports[port]);
+            }
+
+            if (model.ports[port].present && !port_usable(model.ports[port]) && port_usable(prev_model.ports[port])) {
+                ESP_LOGW(TAG, "uart[%u]: invalid, keeping its previous settings", port);
+                model.ports[port] = prev_model.ports[port];
+            }
+        }
     }
 
-    if (rx_pin > GPIO_NUM_MAX || rx_pin < 0) {
-        rx = GPIO_NUM_NC;
-    } else {
-        rx = (gpio_num_t)rx_pin;
+    JsonObject ret_obj = {};
+    if (get_section("retention", ret_obj)) {
+        model.reserve_bytes = (uint64_t)get_uint(ret_obj, "retention", "reserve_mb", DEFAULT_RESERVE_MB) * 1024 * 1024;
+        model.segment_bytes = (uint64_t)get_uint(ret_obj, "retention", "segment_mb", DEFAULT_SEGMENT_MB) * 1024 * 1024; // Capped to what the filesystem allows
+    }
+
+    JsonObject merge_obj = {};
+    if (get_section("merge", merge_obj)) {
+        model.merge_enable = get_enable(merge_obj, "merge");
+        model.merge_window_ms = get_uint(merge_obj, "merge", "window_ms", DEFAULT_MERGE_WINDOW_MS); // How long a quiet channel can hold back the others
+        bool merge_ok = get_compress(merge_obj, "merge", model.merge_compress);
+        merge_ok = get_quota(merge_obj, "merge", model.merge_quota_bytes) && merge_ok;
+        if (!merge_ok) {
+            model.merge_enable = false;
+        }
+    }
+
+    JsonObject sniff_obj = {};
+    if (get_section("sniffer", sniff_obj)) {
+        model.sniffer_enable = get_enable(sniff_obj, "sniffer");
+        uint32_t idle = get_uint(sniff_obj, "sniffer", "idle_symbols", DEFAULT_SNIFFER_IDLE_SYMBOLS); // Line idle this long (in characters) ends a run
+        uint32_t idle_max = UINT8_MAX;
+        for (const auto &port : model.ports) {
+            if (port_usable(port) && max_idle_symbols(port.uart) < idle_max) {
+                idle_max = max_idle_symbols(port.uart);
+            }
+        }
+
+        if (idle == 0 || idle > idle_max) {
+            ESP_LOGE(TAG, "sniffer.idle_symbols: %lu out of range 1..%lu for the ports' framing", idle, idle_max);
+            idle = DEFAULT_SNIFFER_IDLE_SYMBOLS;
+        }
+
+        model.sniffer_idle_symbols = (uint8_t)idle;
+    }
+
+    JsonObject tail_obj = {};
+    if (get_section("tail", tail_obj)) {
+        model.tail_enable = get_enable(tail_obj, "tail");
+        const char *policy_str = get_str(tail_obj, "policy", "drop");
+        if (strcmp(policy_str, "drop") == 0) {
+            model.tail_policy = BUS_POLICY_DROP;
+        } else if (strcmp(policy_str, "block") == 0) {
+            model.tail_policy = BUS_POLICY_BLOCK;
+        } else if (strcmp(policy_str, "detach") == 0) {
+            model.tail_policy = BUS_POLICY_DETACH;
+        } else {
+            ESP_LOGE(TAG, "tail.policy: unknown policy \'%s\', expected drop, block or detach", policy_str);
+            model.tail_enable = false;
+        }
+    }
+}
+
+void config_loader::build_port(size_t port, JsonObject obj, port_cfg &cfg)
+{
+    // A bad field disables the port it's in, get_uart_cfg() hands the error back
+    cfg.present = true;
+    cfg.status = ESP_OK;
+    char section[16] = {};
+    snprintf(section, sizeof(section), "uart[%u]", port);
+    bool fields_ok = get_pin(obj, section, "tx_pin", cfg.tx);
+    fields_ok = get_pin(obj, section, "rx_pin", cfg.rx) && fields_ok;
+    fields_ok = get_pin(obj, section, "rts_pin", cfg.rts) && fields_ok;
+    fields_ok = get_pin(obj, section, "cts_pin", cfg.cts) && fields_ok;
+    fields_ok = get_compress(obj, section, cfg.compress) && fields_ok;
+    fields_ok = get_quota(obj, section, cfg.quota_bytes) && fields_ok;
+    if (!fields_ok) {
+        cfg.status = ESP_ERR_INVALID_ARG;
     }
 
-    if (cts_pin > GPIO_NUM_MAX || cts_pin < 0) {
-        cts = GPIO_NUM_NC;
+    cfg.uart.flags.allow_pd = 0;
+    cfg.uart.source_clk = UART_SCLK_RTC;
+    if (!obj["baudRate"].is<uint32_t>() || obj["baudRate"].as<uint32_t>() == 0) {
+        ESP_LOGE(TAG, "uart[%u].baudRate: missing or not a positive integer", port);
+        cfg.status = ESP_ERR_INVALID_ARG;
     } else {
-        cts = (gpio_num_t)cts_pin;
+        cfg.uart.baud_rate = (int)obj["baudRate"].as<uint32_t>();
     }
 
-    if (rts_pin > GPIO_NUM_MAX || rts_pin < 0) {
-        rts = GPIO_NUM_NC;
+    // Compared in half bits, exact for 1, 1.5 and 2 without any float literals involved. Not a number counts as 0
+    auto stop_field = obj["stopBit"];
+    double stop_half = stop_field.isNull() ? 2 : (stop_field.is<double>() ? stop_field.as<double>() * 2 : 0);
+    if (stop_half == 2) {
+        cfg.uart.stop_bits = UART_STOP_BITS_1;
+    } else if (stop_half == 3) {
+        cfg.uart.stop_bits = UART_STOP_BITS_1_5;
+    } else if (stop_half == 4) {
+        cfg.uart.stop_bits = UART_STOP_BITS_2;
     } else {
-        rts = (gpio_num_t)rts_pin;
+        ESP_LOGE(TAG, "uart[%u].stopBit: expected 1, 1.5 or 2", port);
+        cfg.status = ESP_ERR_INVALID_ARG;
     }
 
-    if (cfg_out == nullptr) {
-        return ESP_OK;
+    auto data_field = obj["dataBit"];
+    uint32_t data_bits = data_field.isNull() ? 8 : (data_field.is<uint32_t>() ? data_field.as<uint32_t>() : 0);
+    if (data_bits >= 5 && data_bits <= 8) {
+        cfg.uart.data_bits = (uart_word_length_t)(UART_DATA_5_BITS + (data_bits - 5));
+    } else {
+        ESP_LOGE(TAG, "uart[%u].dataBit: expected 5..8", port);
+        cfg.status = ESP_ERR_INVALID_ARG;
     }
 
-    cfg_out->flags.allow_pd = 0;
-    cfg_out->source_clk = UART_SCLK_RTC;
-    cfg_out->baud_rate = cfg_obj["baudRate"].as<int>();
+    const char *parity_str = get_str(obj, "parity", "none");
+    if (strcmp(parity_str, "none") == 0) {
+        cfg.uart.parity = UART_PARITY_DISABLE;
+    } else if (strcmp(parity_str, "odd") == 0) {
+        cfg.uart.parity = UART_PARITY_ODD;
+    } else if (strcmp(parity_str, "even") == 0) {
+        cfg.uart.parity = UART_PARITY_EVEN;
+    } else {
+        ESP_LOGE(TAG, "uart[%u].parity: \'%s\', expected none, odd or even", port, parity_str);
+        cfg.status = ESP_ERR_INVALID_ARG;
+    }
 
-    if (cfg_obj["stopBit"].as<double>() == 1.0f) {
-        cfg_out->stop_bits = UART_STOP_BITS_1;
-    } else if (cfg_obj["stopBit"].as<double>() == 1.5f) {
-        cfg_out->stop_bits = UART_STOP_BITS_1_5;
-    } else if (cfg_obj["stopBit"].as<double>() == 2.0f) {
-        cfg_out->stop_bits = UART_STOP_BITS_2;
+    // Whole-word matches, a substring search takes "rtscts" for "rts"
+    const char *flow_str = get_str(obj, "flowCtrl", "none");
+    if (strcmp(flow_str, "none") == 0) {
+        cfg.uart.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    } else if (strcmp(flow_str, "rtscts") == 0) {
+        cfg.uart.flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS;
+    } else if (strcmp(flow_str, "rts") == 0) {
+        cfg.uart.flow_ctrl = UART_HW_FLOWCTRL_RTS;
+    } else if (strcmp(flow_str, "cts") == 0) {
+        cfg.uart.flow_ctrl = UART_HW_FLOWCTRL_CTS;
     } else {
-        ESP_LOGE(TAG, "Invalid stop bit config: %f", cfg_obj["stopBit"].as<double>());
-        return ESP_ERR_INVALID_RESPONSE;
+        ESP_LOGE(TAG, "uart[%u].flowCtrl: \'%s\', expected none, rts, cts or rtscts", port, flow_str);
+        cfg.status = ESP_ERR_INVALID_ARG;
     }
+}
 
-    switch (cfg_obj["dataBit"].as<uint8_t>()) {
-        case 5: {
-            cfg_out->data_bits = UART_DATA_5_BITS;
-            break;
-        }
+bool config_loader::get_section(const char *name, JsonObject &obj_out)
+{
+    auto section = docs[live_doc][name];
+    if (section.isNull()) {
+        return false;
+    }
 
-        case 6: {
-            cfg_out->data_bits = UART_DATA_6_BITS;
-            break;
-        }
+    if (!section.is<JsonObject>()) {
+        ESP_LOGE(TAG, "\'%s\' isn't an object, using defaults", name);
+        return false;
+    }
 
-        case 7: {
-            cfg_out->data_bits = UART_DATA_7_BITS;
-            break;
-        }
+    obj_out = section.as<JsonObject>();
+    return true;
+}
 
-        case 8: {
-            cfg_out->data_bits = UART_DATA_8_BITS;
-            break;
-        }
+uint32_t config_loader::get_uint(JsonObject obj, const char *section, const char *key, uint32_t def_val)
+{
+    auto field = obj[key];
+    if (field.isNull()) {
+        return def_val;
+    }
 
-        default: {
-            ESP_LOGE(TAG, "Invalid stop bit config: %u", cfg_obj["dataBit"].as<uint8_t>());
-            return ESP_ERR_INVALID_RESPONSE;
-        }
+    if (!field.is<uint32_t>()) {
+        ESP_LOGE(TAG, "%s.%s: not a non-negative integer, using %lu", section, key, def_val);
+        return def_val;
     }
 
-    const char *parity_str = cfg_obj["parity"].as<const char *>();
-    if (parity_str != nullptr && strstr(parity_str, "odd") != nullptr) {
-        cfg_out->parity = UART_PARITY_ODD;
-    } else if (parity_str != nullptr && strstr(parity_str, "even") != nullptr) {
-        cfg_out->parity = UART_PARITY_EVEN;
-    } else {
-        cfg_out->parity = UART_PARITY_DISABLE;
+    return field.as<uint32_t>();
+}
+
+const char *config_loader::get_str(JsonObject obj, const char *key, const char *def_val)
+{
+    // Anything but a string comes back empty, so it fails the caller's match instead of passing as the default
+    auto field = obj[key];
+    if (field.isNull()) {
+        return def_val;
     }
 
+    const char *str = field.as<const char *>();
+    return str != nullptr ? str : "";
+}
 
-    const char *flow_ctrl_str = cfg_obj["flowCtrl"].as<const char *>();
-    if (flow_ctrl_str != nullptr && strstr(flow_ctrl_str, "rts") != nullptr) {
-        cfg_out->flow_ctrl = UART_HW_FLOWCTRL_RTS;
-    } else if (flow_ctrl_str != nullptr && strstr(flow_ctrl_str, "cts") != nullptr) {
-        cfg_out->flow_ctrl = UART_HW_FLOWCTRL_CTS;
-    } else if (flow_ctrl_str != nullptr && strstr(flow_ctrl_str, "rtscts") != nullptr) {
-        cfg_out->flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS;
-    } else {
-        cfg_out->flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+bool config_loader::get_quota(JsonObject obj, const char *section, uint64_t &bytes_out)
+{
+    // 0 = no limit. Past the largest SD card a quota can never kick in, so that's taken as a typo
+    bytes_out = 0;
+    auto field = obj["quota_mb"];
+    if (field.isNull()) {
+        return true;
     }
 
-    return ESP_OK;
+    if (!field.is<uint32_t>() || field.as<uint32_t>() > MAX_QUOTA_MB) {
+        ESP_LOGE(TAG, "%s.quota_mb: expected an integer 0..%lu", section, MAX_QUOTA_MB);
+        return false;
+    }
+
+    bytes_out = (uint64_t)field.as<uint32_t>() * 1024 * 1024;
+    return true;
+}
+
+bool config_loader::get_enable(JsonObject obj, const char *section)
+{
+    // Only a real true turns a feature on, "yes" or 1 leave it off rather than guessing
+    auto field = obj["enable"];
+    if (!field.isNull() && !field.is<bool>()) {
+        ESP_LOGE(TAG, "%s.enable: expected true or false, leaving it off", section);
+        return false;
+    }
+
+    return field | false;
+}
+
+bool config_loader::get_compress(JsonObject obj, const char *section, bool &compress_out)
+{
+    const char *compress_str = get_str(obj, "compress", "none");
+    compress_out = strcmp(compress_str, "lz4") == 0;
+    if (!compress_out && strcmp(compress_str, "none") != 0) {
+        ESP_LOGE(TAG, "%s.compress: \'%s\', expected none or lz4", section, compress_str);
+        return false;
+    }
+
+    return true;
 }
 
-esp_err_t config_loader::reload_config(const char *path)
+bool config_loader::get_pin(JsonObject obj, const char *section, const char *key, gpio_num_t &pin_out)
 {
-    FILE *file = fopen(path, "r");
-    if (!file) {
+    // Missing or negative means not connected
+    pin_out = GPIO_NUM_NC;
+    auto field = obj[key];
+    if (field.isNull()) {
+        return true;
+    }
+
+    if (!field.is<int32_t>()) {
+        ESP_LOGE(TAG, "%s.%s: not a GPIO number", section, key);
+        return false;
+    }
+
+    int32_t pin = field.as<int32_t>();
+    if (pin >= GPIO_NUM_MAX) {
+        ESP_LOGE(TAG, "%s.%s: GPIO%ld doesn't exist", section, key, pin);
+        return false;
+    }
+
+    pin_out = pin < 0 ? GPIO_NUM_NC : (gpio_num_t)pin;
+    return true;
+}
+
+size_t config_loader::serialize_config(char *buf, size_t buf_len)
+{
+    if (buf == nullptr) {
+        return ArduinoJson::measureJson(docs[live_doc]);
+    }
+
+    return ArduinoJson::serializeJson(docs[live_doc], buf, buf_len);
+}
+
+esp_err_t config_loader::reload_config(const char *path, const char *cache_path)
+{
+    int64_t start_us = esp_timer_get_time();
+    struct stat st = {};
+    if (stat(path, &st) != 0) {
         ESP_LOGE(TAG, "Failed to open UART config: %s", path);
         return ESP_FAIL;
     }
 
-    // Get the file size
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    // Taken before reading, so an edit that lands mid-load still shows up as a change
+    watch_mtime = st.st_mtime;
+    watch_size = st.st_size;
+    // Both paths fill the spare document, the live one is only replaced once that worked
+    if (load_cache(cache_path, st.st_mtime, st.st_size) == ESP_OK) {
+        live_doc ^= 1;
+        build_model();
+        save_last_known();
+        ESP_LOGI(TAG, "Config loaded from %s in %lld us, document %u of %u arena bytes", cache_path, esp_timer_get_time() - start_us,
+                 arenas[live_doc].get_used(), arenas[live_doc].get_capacity());
+        return ESP_OK;
+    }
+
+    esp_err_t ret = parse_json(path);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    live_doc ^= 1;
+    build_model();
+    save_last_known();
+
+    ESP_LOGI(TAG, "Config parsed from %s in %lld us, document %u of %u arena bytes", path, esp_timer_get_time() - start_us,
+             arenas[live_doc].get_used(), arenas[live_doc].get_capacity());
+    ret = write_cache(cache_path, st.st_mtime, st.st_size);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't write config cache 0x%x, JSON gets parsed again next boot", ret);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t config_loader::load_last_known()
+{
+    // Only the typed model comes back; the document, and with it the segment snapshot, waits for config.json
+    nvs_handle_t handle = 0;
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    last_known_blob blob = {};
+    size_t len = sizeof(blob);
+    ret = nvs_get_blob(handle, LAST_KNOWN_KEY, &blob, &len);
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (len != sizeof(blob) || blob.magic != LAST_KNOWN_MAGIC || blob.version != LAST_KNOWN_VERSION) {
+        ESP_LOGW(TAG, "Last-known config is from another firmware, waiting for config.json");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    model = blob.model;
+    ESP_LOGI(TAG, "Last-known config loaded from NVS");
+    return ESP_OK;
+}
+
+void config_loader::save_last_known()
+{
+    // NVS goes to flash, which asserts on a task whose stack is in PSRAM, like the writer's on a hot reload.
+    // So it's done on a short-lived task with an internal stack, and this waits for it
+    if (save_done == nullptr && (save_done = xSemaphoreCreateBinary()) == nullptr) {
+        ESP_LOGW(TAG, "Can't save last-known config, no memory");
+        return;
+    }
+
+    if (xTaskCreate(save_task, "cfg_save", SAVE_STACK_SIZE, this, uxTaskPriorityGet(nullptr), nullptr) != pdPASS) {
+        ESP_LOGW(TAG, "Can't start the task that saves the last-known config");
+        return;
+    }
+
+    xSemaphoreTake(save_done, portMAX_DELAY);
+}
+
+void config_loader::save_task(void *_ctx)
+{
+    auto *ctx = (config_loader *)_ctx;
+    ctx->write_last_known();
+    xSemaphoreGive(ctx->save_done);
+    vTaskDelete(nullptr);
+}
 
-    if (file_size >= MAX_CFG_JSON_SIZE_ALLOWED) {
+void config_loader::write_last_known()
+{
+    nvs_handle_t handle = 0;
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't open NVS 0x%x, next boot captures only once config.json is read", ret);
+        return;
+    }
+
+    // Every boot loads the config, only an actual change costs a flash write
+    last_known_blob blob = {};
+    size_t len = sizeof(blob);
+    ret = nvs_get_blob(handle, LAST_KNOWN_KEY, &blob, &len);
+    if (ret == ESP_OK && len == sizeof(blob) && blob.magic == LAST_KNOWN_MAGIC && blob.version == LAST_KNOWN_VERSION &&
+        same_model(blob.model, model)) {
+        nvs_close(handle);
+        return;
+    }
+
+    blob.magic = LAST_KNOWN_MAGIC;
+    blob.version = LAST_KNOWN_VERSION;
+    blob.model = model;
+    ret = nvs_set_blob(handle, LAST_KNOWN_KEY, &blob, sizeof(blob));
+    ret = ret ?: nvs_commit(handle);
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't save last-known config 0x%x", ret);
+    }
+}
+
+bool config_loader::config_changed(const char *path)
+{
+    // Cheap enough for a periodic poll, FAT only keeps 2s mtime resolution so the size is checked too
+    struct stat st = {};
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    return st.st_mtime != watch_mtime || st.st_size != watch_size;
+}
+
+uint32_t config_loader::get_port_changes(uart_port_t port) const
+{
+    if (port < 0 || port >= UART_NUM_MAX) {
+        return PORT_CHANGE_NONE;
+    }
+
+    const port_cfg &prev = prev_model.ports[port];
+    const port_cfg &cur = model.ports[port];
+    bool was_up = port_usable(prev);
+    bool is_up = port_usable(cur);
+    if (was_up != is_up) {
+        return is_up ? PORT_CHANGE_ADDED : PORT_CHANGE_REMOVED;
+    }
+
+    uint32_t changes = PORT_CHANGE_NONE;
+    if (!is_up) {
+        return changes;
+    }
+
+    if (!same_framing(prev.uart, cur.uart)) {
+        changes |= PORT_CHANGE_FRAMING;
+    }
+
+    if (prev.tx != cur.tx || prev.rx != cur.rx || prev.rts != cur.rts || prev.cts != cur.cts) {
+        changes |= PORT_CHANGE_PINS;
+    }
+
+    if (prev.compress != cur.compress || prev.quota_bytes != cur.quota_bytes) {
+        changes |= PORT_CHANGE_SINK;
+    }
+
+    return changes;
+}
+
+bool config_loader::needs_restart() const
+{
+    // Settings that shape the writer itself rather than one port
+    return prev_model.reserve_bytes != model.reserve_bytes || prev_model.merge_enable != model.merge_enable ||
+           prev_model.merge_window_ms != model.merge_window_ms || prev_model.merge_compress != model.merge_compress ||
+           prev_model.merge_quota_bytes != model.merge_quota_bytes || prev_model.sniffer_enable != model.sniffer_enable ||
+           prev_model.sniffer_idle_symbols != model.sniffer_idle_symbols || prev_model.tail_enable != model.tail_enable ||
+           prev_model.tail_policy != model.tail_policy;
+}
+
+bool config_loader::same_model(const config_model &a, const config_model &b)
+{
+    // Field by field, a memcmp would take padding differences for a change and rewrite NVS every boot
+    for (size_t port = 0; port < UART_NUM_MAX; port++) {
+        const port_cfg &pa = a.ports[port];
+        const port_cfg &pb = b.ports[port];
+        if (pa.present != pb.present || pa.status != pb.status || pa.tx != pb.tx || pa.rx != pb.rx || pa.rts != pb.rts ||
+            pa.cts != pb.cts || !same_framing(pa.uart, pb.uart) || pa.compress != pb.compress || pa.quota_bytes != pb.quota_bytes) {
+            return false;
+        }
+    }
+
+    return a.reserve_bytes == b.reserve_bytes && a.segment_bytes == b.segment_bytes && a.merge_enable == b.merge_enable &&
+           a.merge_window_ms == b.merge_window_ms && a.merge_compress == b.merge_compress && a.merge_quota_bytes == b.merge_quota_bytes &&
+           a.sniffer_enable == b.sniffer_enable && a.sniffer_idle_symbols == b.sniffer_idle_symbols && a.tail_enable == b.tail_enable &&
+           a.tail_policy == b.tail_policy;
+}
+
+bool config_loader::same_framing(const uart_config_t &a, const uart_config_t &b)
+{
+    // Field by field, the struct has padding
+    return a.baud_rate == b.baud_rate && a.data_bits == b.data_bits && a.parity == b.parity && a.stop_bits == b.stop_bits &&
+           a.flow_ctrl == b.flow_ctrl && a.rx_flow_ctrl_thresh == b.rx_flow_ctrl_thresh && a.source_clk == b.source_clk;
+}
+
+uint32_t config_loader::max_idle_symbols(const uart_config_t &uart)
+{
+    // The driver's timeout counts bit times up to UART_RX_TOUT_THRHD_V, in symbols of start + data + parity + stop
+    // bits, where 1.5 stop bits count as 2; 102 symbols at 8N1
+    uint32_t symbol_bits = 1 + 5 + (uint32_t)uart.data_bits;
+    symbol_bits += uart.parity != UART_PARITY_DISABLE ? 1 : 0;
+    symbol_bits += uart.stop_bits != UART_STOP_BITS_1 ? 2 : 1;
+    return UART_RX_TOUT_THRHD_V / symbol_bits;
+}
+
+size_t config_loader::arena_size() const
+{
+    // Not scaled to the file, the filter keeps the document small whatever else is in there.
+    // Starts where the last load peaked, a short guess just costs a retry at twice the size
+    size_t peak = arenas[0].get_peak() > arenas[1].get_peak() ? arenas[0].get_peak() : arenas[1].get_peak();
+    return peak > ARENA_MIN_SIZE ? peak : ARENA_MIN_SIZE;
+}
+
+esp_err_t config_loader::load_cache(const char *cache_path, int64_t json_mtime, uint32_t json_size)
+{
+    FILE *file = fopen(cache_path, "rb");
+    if (file == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    cache_header hdr = {};
+    if (fread(&hdr, 1, sizeof(hdr), file) != sizeof(hdr) || hdr.magic != CACHE_MAGIC || hdr.version != CACHE_VERSION) {
         fclose(file);
-        ESP_LOGE(TAG, "Config file too big: %u", file_size);
-        return ESP_ERR_INVALID_SIZE;
+        ESP_LOGW(TAG, "Config cache unreadable, ignoring it");
+        return ESP_ERR_INVALID_VERSION;
     }
 
-    if (cfg_json != nullptr) {
-        free(cfg_json);
-        cfg_json = nullptr;
+    if (hdr.json_mtime != json_mtime || hdr.json_size != json_size) {
+        fclose(file);
+        ESP_LOGI(TAG, "Config changed since the cache was built");
+        return ESP_ERR_INVALID_VERSION;
     }
 
-    cfg_json = (char *) heap_caps_calloc(1, file_size + 1, MALLOC_CAP_SPIRAM);
-    if (cfg_json == nullptr) {
-        ESP_LOGE(TAG, "Can't allocate config file buffer");
-        return ESP_ERR_NO_MEM;
+    if (hdr.filter_crc != esp_rom_crc32_le(0, (const uint8_t *)CONFIG_FILTER, sizeof(CONFIG_FILTER) - 1)) {
+        fclose(file);
+        ESP_LOGI(TAG, "Config cache was built by a firmware with other fields");
+        return ESP_ERR_INVALID_VERSION;
     }
 
-    size_t read_ret = fread(cfg_json, 1, file_size, file);
-    if (read_ret < 1) {
-        ESP_LOGE(TAG, "Read config fail: %d", read_ret);
-        return ESP_ERR_INVALID_STATE;
+    // Decoded as it streams in, the CRC is only known at the end so a bad body is thrown away afterwards
+    setvbuf(file, nullptr, _IONBF, 0);
+    esp_err_t ret = ESP_OK;
+    JsonDocument &doc = docs[live_doc ^ 1];
+    size_t size = arena_size();
+    DeserializationError err = DeserializationError::Ok;
+    do {
+        doc.clear();
+        if (!arenas[live_doc ^ 1].reset(size)) {
+            fclose(file);
+            return ESP_ERR_NO_MEM;
+        }
+
+        fseek(file, sizeof(hdr), SEEK_SET);
+        json_file_reader reader(file, read_buf, sizeof(read_buf));
+        err = ArduinoJson::deserializeMsgPack(doc, reader);
+        reader.finish();
+        if (err == DeserializationError::Ok && (reader.get_total() != hdr.body_len || reader.get_crc() != hdr.body_crc)) {
+            ESP_LOGW(TAG, "Config cache body corrupt, ignoring it");
+            ret = ESP_ERR_INVALID_CRC;
+        }
+
+        size *= 2;
+    } while (err == DeserializationError::NoMemory && size <= ARENA_MAX_SIZE);
+
+    fclose(file);
+    if (err != DeserializationError::Ok) {
+        ESP_LOGW(TAG, "Config cache doesn't decode: %s", err.c_str());
+        ret = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if (ret != ESP_OK) {
+        doc.clear();
     }
 
-    cfg_json[file_size] = '\0';
+    return ret;
+}
+
+esp_err_t config_loader::write_cache(const char *cache_path, int64_t json_mtime, uint32_t json_size)
+{
+    // Written aside and renamed, so a power cut never leaves a half cache behind
+    char tmp_path[64] = {};
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == nullptr) {
+        return ESP_FAIL;
+    }
+
+    // Body streams out behind a blank header, which is filled in once the CRC is known
+    cache_header hdr = {};
+    bool written = fwrite(&hdr, 1, sizeof(hdr), file) == sizeof(hdr);
+    json_file_writer writer(file);
+    size_t body_len = ArduinoJson::serializeMsgPack(docs[live_doc], writer);
+
+    hdr.magic = CACHE_MAGIC;
+    hdr.version = CACHE_VERSION;
+    hdr.json_mtime = json_mtime;
+    hdr.json_size = json_size;
+    hdr.filter_crc = esp_rom_crc32_le(0, (const uint8_t *)CONFIG_FILTER, sizeof(CONFIG_FILTER) - 1);
+    hdr.body_len = writer.get_total();
+    hdr.body_crc = writer.get_crc();
+    written = written && body_len == writer.get_total() && fseek(file, 0, SEEK_SET) == 0;
+    written = written && fwrite(&hdr, 1, sizeof(hdr), file) == sizeof(hdr);
+    written = fflush(file) == 0 && fsync(fileno(file)) == 0 && written;
+    fclose(file);
+
+    auto *sdmmc = sdmmc_manager::instance();
+    uint64_t new_size = sizeof(hdr) + writer.get_total();
+    sdmmc->charge_write(0, new_size);
+
+    struct stat st = {};
+    if (stat(cache_path, &st) == 0 && unlink(cache_path) == 0) {
+        sdmmc->release_space(st.st_size);
+    }
+
+    if (!written || rename(tmp_path, cache_path) != 0) {
+        unlink(tmp_path);
+        sdmmc->release_space(new_size);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t config_loader::parse_json(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Failed to open UART config: %s", path);
+        return ESP_FAIL;
+    }
+
+    // The parser pulls a chunk at a time, so the file never has to fit in RAM next to the document
+    setvbuf(file, nullptr, _IONBF, 0);
+    JsonDocument &doc = docs[live_doc ^ 1];
+    SpiRamArena &arena = arenas[live_doc ^ 1];
+    size_t size = arena_size();
+    DeserializationError ret = DeserializationError::Ok;
+    bool read_failed = false;
+    do {
+        doc.clear();
+        if (!arena.reset(size)) {
+            fclose(file);
+            ESP_LOGE(TAG, "Can't allocate %u bytes for the config document", size);
+            return ESP_ERR_NO_MEM;
+        }
+
+        rewind(file);
+        json_file_reader reader(file, read_buf, sizeof(read_buf));
+
+        // Only keys the model reads get stored, anything else in the file costs no memory
+        JsonDocument filter(&arena);
+        ArduinoJson::deserializeJson(filter, CONFIG_FILTER);
+        ret = ArduinoJson::deserializeJson(doc, reader, DeserializationOption::Filter(filter));
+        read_failed = ferror(file) != 0;
+        size *= 2;
+    } while (ret == DeserializationError::NoMemory && !read_failed && size <= ARENA_MAX_SIZE);
 
     fclose(file);
-    config_doc.clear();
 
-    auto ret = ArduinoJson::deserializeJson(config_doc, cfg_json);
+    if (read_failed) {
+        ESP_LOGE(TAG, "Read config fail: %s", path);
+        return ESP_ERR_INVALID_STATE;
+    }
+
     if (ret != DeserializationError::Ok) {
         ESP_LOGE(TAG, "Failed to parse config JSON: %s", ret.c_str());
         return ESP_ERR_INVALID_RESPONSE;
-    } else {
-        free(cfg_json);
-        cfg_json = nullptr;
     }
 
     return ESP_OK;
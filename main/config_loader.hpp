@@ -1,9 +1,24 @@
 #pragma once
 
+#include <sys/types.h>
 #include <ArduinoJson.hpp>
 #include <driver/gpio.h>
 #include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "PsramAllocator.hpp"
+#include "record_bus.hpp"
+
+// What a reload changed for one port, as a bit set
+enum port_change : uint32_t
+{
+    PORT_CHANGE_NONE = 0,
+    PORT_CHANGE_FRAMING = 1 << 0, // Baud rate, word format or flow control, applied to the running driver
+    PORT_CHANGE_PINS = 1 << 1, // Applied to the running driver
+    PORT_CHANGE_SINK = 1 << 2, // Compression or quota
+    PORT_CHANGE_ADDED = 1 << 3,
+    PORT_CHANGE_REMOVED = 1 << 4, // Bad or missing now, the port goes down once its ring is drained
+};
 
 class config_loader
 {
@@ -21,17 +36,130 @@ private:
     config_loader() = default;
 
 public:
-    esp_err_t reload_config(const char *path = "/sdcard/config.json");
+    esp_err_t reload_config(const char *path = "/sdcard/config.json", const char *cache_path = "/sdcard/config.bin");
+    esp_err_t load_last_known();
     esp_err_t get_uart_cfg(uart_port_t port, gpio_num_t &tx, gpio_num_t &rx, gpio_num_t &rts, gpio_num_t &cts, uart_config_t *cfg_out);
+    esp_err_t get_sink_cfg(uart_port_t port, bool &compress, uint64_t &quota_bytes);
+    esp_err_t get_retention_cfg(uint64_t &reserve_bytes, uint64_t &segment_bytes);
+    esp_err_t get_merge_cfg(bool &enable, uint32_t &window_ms, bool &compress, uint64_t &quota_bytes);
+    esp_err_t get_sniffer_cfg(bool &enable, uint8_t &idle_symbols);
+    esp_err_t get_tail_cfg(bool &enable, bus_policy &policy);
+    size_t serialize_config(char *buf, size_t buf_len);
+    bool config_changed(const char *path = "/sdcard/config.json");
+    uint32_t get_port_changes(uart_port_t port) const;
+    bool needs_restart() const;
+
+private:
+    static const constexpr size_t READ_CHUNK_SIZE = 1024;
+
+    struct port_cfg
+    {
+        bool present;
+        esp_err_t status; // First bad field, the port stays down if set
+        gpio_num_t tx;
+        gpio_num_t rx;
+        gpio_num_t rts;
+        gpio_num_t cts;
+        uart_config_t uart;
+        bool compress;
+        uint64_t quota_bytes;
+    };
+
+    // Everything the firmware reads from config.json, filled in once per load
+    struct config_model
+    {
+        port_cfg ports[UART_NUM_MAX];
+        uint64_t reserve_bytes;
+        uint64_t segment_bytes;
+        bool merge_enable;
+        uint32_t merge_window_ms;
+        bool merge_compress;
+        uint64_t merge_quota_bytes;
+        bool sniffer_enable;
+        uint8_t sniffer_idle_symbols;
+        bool tail_enable;
+        bus_policy tail_policy;
+    };
+
+    // config.bin: this header, then the filtered document as MessagePack. The model is rebuilt from that document on
+    // every load, so the cache only goes stale when config.json or CONFIG_FILTER changes, and both are in the key
+    struct __attribute__((packed)) cache_header
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t reserved;
+        int64_t json_mtime; // stat() of the config.json it was compiled from, FAT's 2s mtime is why the size is kept too
+        uint32_t json_size;
+        uint32_t filter_crc; // A firmware that keeps more or fewer fields can't use the document
+        uint32_t body_len;
+        uint32_t body_crc;
+    };
+
+    static_assert(sizeof(cache_header) == 32, "cache_header layout changed");
+
+    // The model as of the last good load, kept in NVS so capture can start before the card is up
+    struct last_known_blob
+    {
+        uint32_t magic;
+        uint32_t version;
+        config_model model;
+    };
 
+    esp_err_t parse_json(const char *path);
+    size_t arena_size() const;
+    void build_model();
+    static bool port_usable(const port_cfg &cfg) { return cfg.present && cfg.status == ESP_OK; }
+    static bool same_model(const config_model &a, const config_model &b);
+    static bool same_framing(const uart_config_t &a, const uart_config_t &b);
+    static uint32_t max_idle_symbols(const uart_config_t &uart);
+    void build_port(size_t port, JsonObject obj, port_cfg &cfg);
+    bool get_section(const char *name, JsonObject &obj_out);
+    static uint32_t get_uint(JsonObject obj, const char *section, const char *key, uint32_t def_val);
+    static const char *get_str(JsonObject obj, const char *key, const char *def_val);
+    static bool get_quota(JsonObject obj, const char *section, uint64_t &bytes_out);
+    static bool get_enable(JsonObject obj, const char *section);
+    static bool get_compress(JsonObject obj, const char *section, bool &compress_out);
+    static bool get_pin(JsonObject obj, const char *section, const char *key, gpio_num_t &pin_out);
+    esp_err_t load_cache(const char *cache_path, int64_t json_mtime, uint32_t json_size);
+    esp_err_t write_cache(const char *cache_path, int64_t json_mtime, uint32_t json_size);
+    void save_last_known();
+    void write_last_known();
+    static void save_task(void *_ctx);
 
 private:
-    char *cfg_json = nullptr;
-    SpiRamAllocator json_allocator = {};
-    ArduinoJson::JsonDocument config_doc = ArduinoJson::JsonDocument(&json_allocator);
+    // A reload fills the spare document and only then makes it live, so a bad file leaves the old one intact.
+    // Arenas are reset, not freed
+    SpiRamArena arenas[2] = {};
+    ArduinoJson::JsonDocument docs[2] = {ArduinoJson::JsonDocument(&arenas[0]), ArduinoJson::JsonDocument(&arenas[1])};
+    uint8_t live_doc = 0; // Kept for the segment header snapshot
+    config_model model = {};
+    config_model prev_model = {}; // What the last reload replaced, for get_port_changes()
+    time_t watch_mtime = 0;
+    off_t watch_size = -1;
+    char read_buf[READ_CHUNK_SIZE] = {}; // Parsing and cache reads stream through it, the file is never loaded whole
+    SemaphoreHandle_t save_done = nullptr;
 
 private:
     static const constexpr char TAG[] = "cfg_loader";
-    static const constexpr uint32_t MAX_CFG_JSON_SIZE_ALLOWED = 131072;
+    static const constexpr uint32_t CACHE_MAGIC = 0x43434c53; // "SLCC"
+    static const constexpr uint16_t CACHE_VERSION = 3;
+    static const constexpr char NVS_NAMESPACE[] = "soullogger";
+    static const constexpr char LAST_KNOWN_KEY[] = "last_cfg";
+    static const constexpr uint32_t LAST_KNOWN_MAGIC = 0x4b4c4c53; // "SLLK"
+    static const constexpr uint32_t LAST_KNOWN_VERSION = 1; // Bump whenever config_model changes
+    static const constexpr char CONFIG_FILTER[] =
+            R"({"uart":[{"tx_pin":true,"rx_pin":true,"rts_pin":true,"cts_pin":true,"baudRate":true,"stopBit":true,)"
+            R"("dataBit":true,"parity":true,"flowCtrl":true,"compress":true,"quota_mb":true}],)"
+            R"("retention":{"reserve_mb":true,"segment_mb":true},)"
+            R"("merge":{"enable":true,"window_ms":true,"compress":true,"quota_mb":true},)"
+            R"("sniffer":{"enable":true,"idle_symbols":true},"tail":{"enable":true,"policy":true}})";
+    static const constexpr size_t ARENA_MIN_SIZE = 16384; // ArduinoJson grabs whole slot pages, a small config already needs ~10KB
+    static const constexpr size_t ARENA_MAX_SIZE = 1048576;
+    static const constexpr uint32_t SAVE_STACK_SIZE = 4096;
+    static const constexpr uint32_t DEFAULT_RESERVE_MB = 256;
+    static const constexpr uint32_t MAX_QUOTA_MB = 2097152; // 2TB, the SDXC ceiling
+    static const constexpr uint32_t DEFAULT_SEGMENT_MB = 64;
+    static const constexpr uint32_t DEFAULT_MERGE_WINDOW_MS = 20;
+    static const constexpr uint8_t DEFAULT_SNIFFER_IDLE_SYMBOLS = 4;
 };
 
@@ -0,0 +1,68 @@
+#include <cstdio>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "console_tail.hpp"
+
+esp_err_t console_tail::init(bus_policy _policy)
+{
+    auto *bus = record_bus::instance();
+    esp_err_t ret = bus->init();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    policy = _policy;
+    sub_id = bus->subscribe("tail", policy);
+    if (sub_id < 0) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreateWithCaps(tail_task, "console_tail", 4096, this, tskIDLE_PRIORITY + 1, &task_handle, MALLOC_CAP_SPIRAM) != pdPASS) {
+        bus->unsubscribe(sub_id);
+        sub_id = -1;
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void console_tail::tail_task(void *_ctx)
+{
+    auto *ctx = (console_tail *)_ctx;
+    auto *bus = record_bus::instance();
+    uint32_t dropped_seen = 0;
+    while (true) {
+        // Give the console a moment to drain, then pick up from the newest block again
+        if (ctx->sub_id < 0) {
+            vTaskDelay(pdMS_TO_TICKS(RESUBSCRIBE_DELAY_MS));
+            ctx->sub_id = bus->subscribe("tail", ctx->policy);
+            dropped_seen = 0;
+            continue;
+        }
+
+        const bus_block *block = bus->receive(ctx->sub_id, pdMS_TO_TICKS(RECEIVE_WAIT_MS));
+        bus_sub_stats stats = {};
+        bus->get_stats(ctx->sub_id, stats);
+        if (stats.blocks_dropped != dropped_seen) {
+            ESP_LOGW(TAG, "Console too slow, skipped %lu block(s)", stats.blocks_dropped - dropped_seen);
+            dropped_seen = stats.blocks_dropped;
+        }
+
+        if (block == nullptr) {
+            if (stats.detached) {
+                ESP_LOGW(TAG, "Detached after falling behind, resubscribing");
+                bus->unsubscribe(ctx->sub_id);
+                ctx->sub_id = -1;
+            }
+
+            continue;
+        }
+
+        for (const bus_record *rec = block->first(); rec != nullptr; rec = block->next(rec)) {
+            printf("uart%u: %.*s", rec->channel, rec->len, (const char *)rec->data());
+        }
+
+        fflush(stdout);
+        bus->release(ctx->sub_id);
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "record_bus.hpp"
+
+// Live copy of the capture on the console, fed from the record bus
+class console_tail
+{
+public:
+    static console_tail *instance()
+    {
+        static console_tail _instance;
+        return &_instance;
+    }
+
+    console_tail(console_tail const &) = delete;
+    void operator=(console_tail const &) = delete;
+
+private:
+    console_tail() = default;
+
+public:
+    esp_err_t init(bus_policy _policy);
+    static void tail_task(void *_ctx);
+
+private:
+    int sub_id = -1;
+    bus_policy policy = BUS_POLICY_DROP;
+    TaskHandle_t task_handle = nullptr;
+
+private:
+    static const constexpr uint32_t RECEIVE_WAIT_MS = 1000;
+    static const constexpr uint32_t RESUBSCRIBE_DELAY_MS = 1000;
+    static const constexpr char TAG[] = "tail";
+};
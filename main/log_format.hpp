@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+
+// On-card segment layout, mirrored by tools/slg/container.py:
+//
+//   file_header | config snapshot (JSON) | block_header | payload | block_header | payload | ...
+//
+// A file_header may show up again at a block boundary when a later boot appends to the same file.
+// Block payloads are a run of record_header + line bytes, optionally compressed as a whole.
+//
+// The merged segment interleaves all channels by time; its blocks have BLOCK_FLAG_TAGGED and
+// every record starts with the source channel byte.
+//
+// A block with BLOCK_FLAG_GAP carries a gap_record instead of line records, marking a stretch
+// where the card was unavailable.
+//
+// Each segment has a sparse time index sidecar (same name, .idx) holding an index_entry every
+// few blocks, so the host can binary-search a time window instead of scanning the segment.
+namespace log_format
+{
+    static const constexpr uint32_t FILE_MAGIC = 0x46474c53; // "SLGF"
+    static const constexpr uint32_t BLOCK_MAGIC = 0x42474c53; // "SLGB"
+    static const constexpr uint32_t INDEX_MAGIC = 0x49474c53; // "SLGI"
+    static const constexpr uint16_t VERSION = 1;
+    static const constexpr uint8_t MERGED_CHANNEL = 3; // Past the last UART, ESP32-S3 has UART0..2
+
+    enum codec_type : uint8_t
+    {
+        CODEC_NONE = 0,
+        CODEC_LZ4 = 1,
+    };
+
+    enum block_flags : uint16_t
+    {
+        BLOCK_FLAG_GAP = 0x0001,
+        BLOCK_FLAG_TAGGED = 0x0002,
+    };
+
+    struct __attribute__((packed)) file_header
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t channel;
+        uint8_t reserved;
+        uint32_t boot_id;
+        int64_t created_us;
+        char fw_version[32];
+        uint32_t config_len;
+        uint32_t config_crc;
+        uint32_t header_crc; // Over everything above
+    };
+
+    struct __attribute__((packed)) block_header
+    {
+        uint32_t magic;
+        uint8_t channel;
+        uint8_t codec;
+        uint16_t flags;
+        uint32_t seq;
+        int64_t first_ts_us;
+        int64_t last_ts_us;
+        uint32_t record_count;
+        uint32_t raw_len;
+        uint32_t stored_len;
+        uint32_t payload_crc; // Over the stored (possibly compressed) payload
+        uint32_t header_crc; // Over everything above
+    };
+
+    struct __attribute__((packed)) record_header
+    {
+        uint32_t ts_delta_us; // From block_header::first_ts_us
+        uint16_t len;
+    };
+
+    struct __attribute__((packed)) gap_record
+    {
+        int64_t offline_us; // Wall clock when the card went away
+        int64_t online_us; // and when it was writable again
+        uint32_t dropped_lines; // Lines that didn't fit in RAM meanwhile
+        uint32_t reserved;
+    };
+
+    struct __attribute__((packed)) index_entry
+    {
+        uint32_t magic;
+        uint32_t seq;
+        int64_t ts_us; // first_ts_us of the block
+        uint64_t offset; // Of the block header in the segment
+        uint32_t crc; // Over everything above
+        uint32_t reserved;
+    };
+
+    static_assert(sizeof(file_header) == 64, "file_header layout changed");
+    static_assert(sizeof(block_header) == 48, "block_header layout changed");
+    static_assert(sizeof(record_header) == 6, "record_header layout changed");
+    static_assert(sizeof(gap_record) == 24, "gap_record layout changed");
+    static_assert(sizeof(index_entry) == 32, "index_entry layout changed");
+}
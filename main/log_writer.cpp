@@ -1,24 +1,909 @@
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <esp_heap_caps.h>
+#include <nvs.h>
+#include <nvs_flash.h>
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "log_writer.hpp"
 #include "sdmmc_manager.hpp"
+#include "segment_journal.hpp"
+#include "retention_manager.hpp"
+#include "record_bus.hpp"
+#include "console_tail.hpp"
+#include "boot_timing.hpp"
 
 esp_err_t log_writer::init()
 {
-    esp_err_t ret = sdmmc_manager::instance()->init();
+#ifdef CONFIG_SL_RING_BENCH_AT_BOOT
+    uart_manager::run_ingest_bench();
+#endif
+
+    // The card takes hundreds of ms to seconds to come up, so it does that on its own task
+    // while NVS and the UARTs are set up here
+    auto *timing = boot_timing::instance();
+    card_ready = xSemaphoreCreateBinary();
+    bool card_async = card_ready != nullptr &&
+                      xTaskCreatePinnedToCoreWithCaps(card_task, "boot_sd", 8192, this, tskIDLE_PRIORITY + 4, nullptr, WRITER_CORE, MALLOC_CAP_SPIRAM) == pdPASS;
+
+    // NVS holds the boot count and the config capture starts on, so the target's boot banner
+    // lands in the rings instead of being lost to the mount
+    auto *cfg = config_loader::instance();
+    timing->begin(BOOT_PHASE_NVS);
+    boot_id = next_boot_count();
+    esp_err_t ret = cfg->load_last_known();
+    timing->end(BOOT_PHASE_NVS);
+    if (ret != ESP_OK) {
+        ESP_LOGI(TAG, "No last-known config (0x%x), capture starts once config.json is read", ret);
+    }
+
+    timing->begin(BOOT_PHASE_EARLY_CAPTURE);
+    bool early = ret == ESP_OK && start_early_capture();
+    timing->end(BOOT_PHASE_EARLY_CAPTURE);
+
+    if (card_async) {
+        xSemaphoreTake(card_ready, portMAX_DELAY);
+        ret = card_ret;
+    } else {
+        ret = bring_up_card();
+    }
+
+    if (card_ready != nullptr) {
+        vSemaphoreDelete(card_ready);
+        card_ready = nullptr;
+    }
+
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Can't set up SD card 0x%x", ret);
+        // Nothing is ever going to drain the rings, so the early ports don't get to keep filling them
+        for (auto &chan : channels) {
+            if (chan.uart.is_running()) {
+                chan.uart.stop();
+            }
+        }
+
+        return ret;
+    }
+
+    timing->begin(BOOT_PHASE_CONFIG);
+    ret = cfg->reload_config();
+    if (ret != ESP_OK && !early) {
+        ESP_LOGE(TAG, "Can't load config 0x%x", ret);
+        return ret;
+    } else if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't load config 0x%x, staying on the last-known one", ret);
+    }
+
+    bool reconcile = early && ret == ESP_OK;
+    refresh_snapshot();
+    timing->end(BOOT_PHASE_CONFIG);
+
+    // Oldest segments get deleted to keep a free-space reserve, so capture never stops on a full card
+    timing->begin(BOOT_PHASE_RETENTION);
+    uint64_t reserve_bytes = 0;
+    cfg->get_retention_cfg(reserve_bytes, segment_cfg_size);
+    update_segment_limit();
+    ret = retention_manager::instance()->init(reserve_bytes);
+    timing->end(BOOT_PHASE_RETENTION);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Retention not running 0x%x, card will fill up", ret);
+    }
+
+    // Sniffer: both UARTs tap one link, one per direction, and capture raw byte runs into a single tagged segment
+    uint8_t idle_symbols = 0;
+    bool early_sniffer = sniffer;
+    cfg->get_sniffer_cfg(sniffer, idle_symbols);
+    for (auto &chan : channels) {
+        chan.own_segment = !sniffer;
+    }
+
+    // Early ports captured their backlog with the last-known config, which config.json may change. Segments that take
+    // such a backlog carry no snapshot rather than the wrong one, and rotate once it's written out
+    bool stale[sizeof(channels) / sizeof(channels[0])] = {};
+    uint32_t changes[sizeof(channels) / sizeof(channels[0])] = {};
+    bool backlog_stale = false;
+    for (size_t idx = 0; idx < sizeof(channels) / sizeof(channels[0]); idx++) {
+        changes[idx] = reconcile ? cfg->get_port_changes(channels[idx].uart.get_port()) : PORT_CHANGE_NONE;
+        stale[idx] = channels[idx].uart.is_running() && (changes[idx] != PORT_CHANGE_NONE || early_sniffer != sniffer);
+        backlog_stale = backlog_stale || stale[idx];
+    }
+
+    // Optional extra segment with every channel on one timeline, the per-channel ones are still written.
+    // Opened ahead of the channels, lines captured since power-on may go out while they're reconciled.
+    timing->begin(BOOT_PHASE_CHANNELS);
+    uint32_t window_ms = 0;
+    uint64_t merge_quota = 0;
+    merged.info = {};
+    merged.info.channel = log_format::MERGED_CHANNEL;
+    merged.info.boot_id = boot_id;
+    merged.info.config = backlog_stale ? nullptr : cfg_snapshot;
+    merged.info.config_len = backlog_stale ? 0 : cfg_snapshot_len;
+    merged.info.write_batch = sdmmc_manager::instance()->get_write_batch_size();
+    merged.info.tagged = true;
+    cfg->get_merge_cfg(merge_enabled, window_ms, merged.info.compress, merge_quota);
+    merge_slack_us = (int64_t)window_ms * 1000;
+    merge_enabled = merge_enabled || sniffer;
+    if (merge_enabled) {
+        retention_manager::instance()->set_quota(merged.info.channel, merge_quota);
+        esp_err_t merge_ret = open_segment(merged);
+        if (merge_ret != ESP_OK && sniffer) {
+            ESP_LOGE(TAG, "Can't open sniffer segment 0x%x", merge_ret);
+            return merge_ret;
+        } else if (merge_ret != ESP_OK) {
+            ESP_LOGW(TAG, "Can't open merged segment 0x%x, merging off", merge_ret);
+            merge_enabled = false;
+        }
+    }
+
+    // Early ports get their first segment with the backlog, then config.json is applied to them like a live reload
+    for (size_t idx = 0; idx < sizeof(channels) / sizeof(channels[0]); idx++) {
+        log_channel &chan = channels[idx];
+        if (!chan.uart.is_running()) {
+            chan.uart.set_run_capture(sniffer ? idle_symbols : 0);
+        }
+
+        ret = init_channel(chan, !stale[idx]);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "UART%d not configured, 0x%x", chan.uart.get_port(), ret);
+        }
+    }
+
+    update_merge_window();
+    if (backlog_stale) {
+        flush_backlog();
+        esp_err_t rotate_ret = ESP_OK;
+        for (size_t idx = 0; idx < sizeof(channels) / sizeof(channels[0]); idx++) {
+            log_channel &chan = channels[idx];
+            if (!stale[idx] || !chan.active) {
+                continue;
+            }
+
+            chan.sink.info.config = cfg_snapshot;
+            chan.sink.info.config_len = cfg_snapshot_len;
+            if (early_sniffer != sniffer && !(changes[idx] & PORT_CHANGE_REMOVED)) {
+                // The driver is set up for lines or for runs, so a mode change means starting it over
+                apply_port_changes(chan, PORT_CHANGE_REMOVED);
+                chan.uart.set_run_capture(sniffer ? idle_symbols : 0);
+                ret = init_channel(chan);
+                continue;
+            }
+
+            apply_port_changes(chan, changes[idx]);
+            bool in_place = !(changes[idx] & (PORT_CHANGE_ADDED | PORT_CHANGE_REMOVED));
+            if (in_place && chan.active && chan.own_segment && storage_online) {
+                rotate_ret = rotate_ret ?: rotate_segment(chan.sink);
+            }
+        }
+
+        update_merge_window();
+        merged.info.config = cfg_snapshot;
+        merged.info.config_len = cfg_snapshot_len;
+        if (merge_enabled && storage_online) {
+            rotate_ret = rotate_ret ?: rotate_segment(merged);
+        }
+
+        if (rotate_ret != ESP_OK) {
+            go_offline();
+        }
+    }
+    if (merge_enabled) {
+        ESP_LOGI(TAG, "%s, reorder window %lld ms", sniffer ? "Sniffing both directions" : "Merging channels", merge_window_us / 1000);
+    }
+
+    timing->end(BOOT_PHASE_CHANNELS);
+
+    // Live subscribers share one copy of each line through the record bus
+    bool tail_enabled = false;
+    bus_policy tail_policy = BUS_POLICY_DROP;
+    cfg->get_tail_cfg(tail_enabled, tail_policy);
+    if (tail_enabled) {
+        esp_err_t tail_ret = console_tail::instance()->init(tail_policy);
+        if (tail_ret != ESP_OK) {
+            ESP_LOGW(TAG, "Console tail not running 0x%x", tail_ret);
+        }
+    }
+
+    // Block assembly and compression stay off the ingest core
+    if (xTaskCreatePinnedToCoreWithCaps(writer_task, "log_writer", 16384, this, tskIDLE_PRIORITY + 2, &writer_task_handle, WRITER_CORE, MALLOC_CAP_SPIRAM) != pdPASS) {
+        ESP_LOGE(TAG, "Can't create writer task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Off the boot path: nothing waits on the record or the card details any more
+    timing->finish();
+    esp_err_t timing_ret = timing->write_record(boot_id);
+    if (timing_ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't write boot timing record 0x%x", timing_ret);
+    }
+
+    sdmmc_manager::instance()->print_info();
+    return ret;
+}
+
+void log_writer::card_task(void *_ctx)
+{
+    auto *ctx = (log_writer *)_ctx;
+    ctx->card_ret = ctx->bring_up_card();
+    xSemaphoreGive(ctx->card_ready);
+    vTaskDeleteWithCaps(nullptr);
+}
+
+esp_err_t log_writer::bring_up_card()
+{
+    auto *timing = boot_timing::instance();
+    timing->begin(BOOT_PHASE_CARD_INIT);
+    esp_err_t ret = sdmmc_manager::instance()->init();
+    timing->end(BOOT_PHASE_CARD_INIT);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+#ifdef CONFIG_SL_SD_BENCH_AT_BOOT
+    sdmmc_manager::instance()->run_write_bench();
+#endif
+
+    // Segments left open by the last boot may end in a torn block, fix them before appending
+    timing->begin(BOOT_PHASE_RECOVERY);
+    esp_err_t recover_ret = segment_journal::instance()->recover();
+    timing->end(BOOT_PHASE_RECOVERY);
+    if (recover_ret != ESP_OK) {
+        ESP_LOGW(TAG, "Segment recovery failed 0x%x", recover_ret);
+    }
+
+    return ESP_OK;
+}
+
+bool log_writer::start_early_capture()
+{
+    // Lines pile up in the rings and the spill pool until the writer has a card to put them on
+    uint8_t idle_symbols = 0;
+    config_loader::instance()->get_sniffer_cfg(sniffer, idle_symbols);
+    size_t started = 0;
+    for (auto &chan : channels) {
+        chan.uart.set_run_capture(sniffer ? idle_symbols : 0);
+        if (chan.uart.init() == ESP_OK) {
+            started++;
+        }
+    }
+
+    ESP_LOGI(TAG, "Capturing on %u port(s) with the last-known config while the card comes up", started);
+    return started > 0;
+}
+
+void log_writer::refresh_snapshot()
+{
+    // Every segment header carries the config it was captured with
+    auto *cfg = config_loader::instance();
+    heap_caps_free(cfg_snapshot);
+    cfg_snapshot_len = cfg->serialize_config(nullptr, 0);
+    cfg_snapshot = (char *)heap_caps_calloc(1, cfg_snapshot_len + 1, MALLOC_CAP_SPIRAM);
+    if (cfg_snapshot != nullptr) {
+        cfg->serialize_config(cfg_snapshot, cfg_snapshot_len + 1);
+    } else {
+        ESP_LOGW(TAG, "Can't allocate config snapshot, segments will go without it");
+        cfg_snapshot_len = 0;
+    }
+}
+
+esp_err_t log_writer::init_channel(log_channel &chan, bool stamp_config)
+{
+    // A port started early is already capturing, it only needs its sink
+    esp_err_t ret = chan.uart.is_running() ? ESP_OK : chan.uart.init();
+    if (ret != ESP_OK) {
         return ret;
     }
 
-    ret = uart1.init();
+    uint64_t quota_bytes = 0;
+    segment_info &info = chan.sink.info;
+    info = {};
+    info.channel = (uint8_t)chan.uart.get_port();
+    info.boot_id = boot_id;
+    info.config = stamp_config ? cfg_snapshot : nullptr;
+    info.config_len = stamp_config ? cfg_snapshot_len : 0;
+    info.write_batch = sdmmc_manager::instance()->get_write_batch_size();
+    config_loader::instance()->get_sink_cfg(chan.uart.get_port(), info.compress, quota_bytes);
+    retention_manager::instance()->set_quota(info.channel, quota_bytes);
+
+    ret = chan.own_segment ? open_segment(chan.sink) : ESP_OK;
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    chan.active = true;
+    return ESP_OK;
+}
+
+void log_writer::update_merge_window()
+{
+    // A sniffer run only shows up a FIFO fill or an idle gap after its stamp, the window has to cover the slowest port
+    merge_window_us = merge_slack_us;
+    for (auto &chan : channels) {
+        int64_t window_us = merge_slack_us + chan.uart.get_run_delay_us();
+        if (chan.active && window_us > merge_window_us) {
+            merge_window_us = window_us;
+        }
+    }
+}
+
+void log_writer::update_segment_limit()
+{
+    // 2GB in practice, see get_max_file_size()
+    uint64_t fs_max = sdmmc_manager::instance()->get_max_file_size() - SEGMENT_SLACK;
+    segment_max_size = segment_cfg_size < fs_max ? segment_cfg_size : fs_max;
+    if (segment_cfg_size > fs_max) {
+        ESP_LOGW(TAG, "Segment size capped to %llu MB by the filesystem", segment_max_size / (1024 * 1024));
+    }
+}
+
+uint32_t log_writer::next_boot_count()
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS unusable (0x%x), erasing; boot count starts over", ret);
+        ret = nvs_flash_erase();
+        ret = ret ?: nvs_flash_init();
+    }
+
+    nvs_handle_t handle = 0;
+    uint32_t boot_cnt = 0;
+    ret = ret ?: nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret == ESP_OK) {
+        nvs_get_u32(handle, "boot_cnt", &boot_cnt); // Stays 0 on first boot
+        boot_cnt++;
+        ret = nvs_set_u32(handle, "boot_cnt", boot_cnt);
+        ret = ret ?: nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    // Still has to be unique per boot, only the ordering is lost
     if (ret != ESP_OK) {
-        ESP_LOGW(TAG, "UART1 not configured, 0x%x", ret);
+        boot_cnt = esp_random();
+        ESP_LOGW(TAG, "Can't keep boot count in NVS 0x%x, using random boot ID 0x%08lx", ret, boot_cnt);
+        return boot_cnt;
     }
 
-    ret = uart2.init();
-    if (ret != ESP_OK){
-        ESP_LOGW(TAG, "UART2 not configured, 0x%x", ret);
+    ESP_LOGI(TAG, "Boot #%lu", boot_cnt);
+    return boot_cnt;
+}
+
+esp_err_t log_writer::open_shard()
+{
+    // One directory per boot, split into shards of bounded size, since FAT looks names up linearly.
+    // Each new directory takes a cluster of the card's free space
+    uint16_t shard = next_shard++;
+    retention_manager::instance()->set_active_shard(boot_id, shard);
+
+    char path[32] = {};
+    snprintf(path, sizeof(path), "/sdcard/%08lX", boot_id);
+    if (mkdir(path, 0775) == 0) {
+        sdmmc_manager::instance()->charge_write(0, 1);
+    } else if (errno != EEXIST) {
+        ESP_LOGE(TAG, "Can't create %s, errno %d", path, errno);
+        return ESP_FAIL;
+    }
+
+    retention_manager::shard_path(boot_id, shard, path, sizeof(path));
+    if (mkdir(path, 0775) == 0) {
+        sdmmc_manager::instance()->charge_write(0, 1);
+    } else if (errno != EEXIST) {
+        ESP_LOGE(TAG, "Can't create %s, errno %d", path, errno);
+        return ESP_FAIL;
+    }
+
+    cur_shard = shard;
+    shard_seg_cnt = 0;
+    shard_start_us = esp_timer_get_time();
+    shard_open = true;
+    return ESP_OK;
+}
+
+esp_err_t log_writer::open_segment(log_sink &sink)
+{
+    if (!shard_open || shard_seg_cnt >= SEGMENTS_PER_SHARD || esp_timer_get_time() - shard_start_us >= SHARD_INTERVAL_US) {
+        esp_err_t ret = open_shard();
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    auto *retention = retention_manager::instance();
+    sink.seg_id = retention->next_segment_id(sink.info.channel);
+    shard_seg_cnt++;
+
+    segment_loc loc = {};
+    loc.channel = sink.info.channel;
+    loc.shard = cur_shard;
+    loc.boot = boot_id;
+    loc.seg_id = sink.seg_id;
+
+    char path[64] = {};
+    retention_manager::segment_path(loc, path, sizeof(path));
+
+    // Journal and manifest both know about the file before its first byte lands
+    segment_journal::instance()->add(path, boot_id);
+    retention->add_segment(loc);
+    return sink.writer.init(path, sink.info);
+}
+
+esp_err_t log_writer::rotate_segment(log_sink &sink)
+{
+    uint64_t size = sink.writer.get_size();
+    esp_err_t ret = sink.writer.close();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Channel %u: closing segment failed 0x%x", sink.info.channel, ret);
+    }
+
+    retention_manager::instance()->close_segment(sink.info.channel, sink.seg_id, size);
+    ret = open_segment(sink);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Channel %u: can't open next segment 0x%x", sink.info.channel, ret);
     }
 
     return ret;
 }
+
+esp_err_t log_writer::service_sink(log_sink &sink)
+{
+    esp_err_t ret = ESP_OK;
+    if (sink.writer.should_flush(esp_timer_get_time())) {
+        ret = sink.writer.flush();
+    }
+
+    if (ret == ESP_OK && sink.writer.get_size() >= segment_max_size) {
+        ret = rotate_segment(sink);
+    }
+
+    return ret;
+}
+
+void log_writer::writer_task(void *_ctx)
+{
+    auto *ctx = (log_writer *)_ctx;
+    while (true) {
+        // While the card is away, lines pile up in the rings and the spill pool
+        if (!ctx->storage_online) {
+            ctx->try_remount();
+            vTaskDelay(pdMS_TO_TICKS(WRITER_IDLE_MS));
+            continue;
+        }
+
+        size_t drained = 0;
+        if (ctx->merge_enabled) {
+            drained = ctx->drain_merged();
+        } else {
+            for (auto &chan : ctx->channels) {
+                if (chan.active && ctx->storage_online) {
+                    drained += ctx->drain_channel(chan);
+                }
+            }
+        }
+
+        record_bus::instance()->flush_stale(esp_timer_get_time());
+        if (ctx->storage_online && esp_timer_get_time() - ctx->last_health_check_us >= HEALTH_CHECK_INTERVAL_US) {
+            ctx->check_sd_health();
+        }
+
+        if (ctx->storage_online && esp_timer_get_time() - ctx->last_config_check_us >= CONFIG_CHECK_INTERVAL_US) {
+            ctx->check_config();
+        }
+
+        if (drained == 0) {
+            vTaskDelay(pdMS_TO_TICKS(WRITER_IDLE_MS));
+        }
+    }
+}
+
+bool log_writer::peek_line(log_channel &chan)
+{
+    if (chan.pending_line != nullptr) {
+        return true;
+    }
+
+    if (chan.uart.wait_for_newline(&chan.pending_line, &chan.pending_len, &chan.pending_ts_us, 0) != ESP_OK) {
+        chan.pending_line = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+esp_err_t log_writer::write_line(log_channel &chan)
+{
+    // Subscribers get the line before the card does, so a slow write doesn't delay them
+    if (!chan.pending_published) {
+        record_bus::instance()->publish(chan.sink.info.channel, chan.pending_line, chan.pending_len, chan.pending_ts_us);
+        chan.pending_published = true;
+    }
+
+    // On failure the line stays pending and gets written first once the card is back
+    if (!chan.pending_in_sink && chan.own_segment) {
+        esp_err_t ret = chan.sink.writer.append(chan.pending_line, chan.pending_len, chan.pending_ts_us);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        chan.pending_in_sink = true;
+    }
+
+    if (merge_enabled) {
+        esp_err_t ret = merged.writer.append_tagged(chan.pending_line, chan.pending_len, chan.pending_ts_us, chan.sink.info.channel);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    chan.uart.finish_newline(chan.pending_line);
+    chan.pending_line = nullptr;
+    chan.pending_in_sink = false;
+    chan.pending_published = false;
+    return ESP_OK;
+}
+
+size_t log_writer::drain_channel(log_channel &chan)
+{
+    size_t count = 0;
+    esp_err_t ret = ESP_OK;
+    while (count < DRAIN_BATCH && peek_line(chan)) {
+        ret = write_line(chan);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        count++;
+    }
+
+    ret = ret ?: service_sink(chan.sink);
+    if (ret != ESP_OK) {
+        go_offline();
+    }
+
+    return count;
+}
+
+void log_writer::flush_backlog()
+{
+    // Everything captured so far goes out; merged, it's oldest first with no window, nothing is held for a quiet channel
+    if (merge_enabled) {
+        int64_t window_us = merge_window_us;
+        merge_window_us = 0;
+        while (storage_online && drain_merged() > 0) {
+        }
+
+        merge_window_us = window_us;
+        return;
+    }
+
+    for (auto &chan : channels) {
+        while (chan.active && storage_online && drain_channel(chan) > 0) {
+        }
+    }
+}
+
+size_t log_writer::drain_merged()
+{
+    // K-way merge over the channel heads: the oldest head goes out once every channel has one,
+    // or once it's older than the reorder window, since a quiet channel can't produce anything older by then
+    size_t count = 0;
+    esp_err_t ret = ESP_OK;
+    while (count < DRAIN_BATCH * 2) {
+        log_channel *next = nullptr;
+        bool all_ready = true;
+        for (auto &chan : channels) {
+            if (!chan.active) {
+                continue;
+            }
+
+            if (!peek_line(chan)) {
+                all_ready = false;
+                continue;
+            }
+
+            if (next == nullptr || chan.pending_ts_us < next->pending_ts_us) {
+                next = &chan;
+            }
+        }
+
+        if (next == nullptr || (!all_ready && wall_time_us() - next->pending_ts_us < merge_window_us)) {
+            break;
+        }
+
+        ret = write_line(*next);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        count++;
+    }
+
+    for (auto &chan : channels) {
+        if (chan.active && chan.own_segment) {
+            ret = ret ?: service_sink(chan.sink);
+        }
+    }
+
+    ret = ret ?: service_sink(merged);
+    if (ret != ESP_OK) {
+        go_offline();
+    }
+
+    return count;
+}
+
+int64_t log_writer::wall_time_us()
+{
+    struct timeval now = {};
+    gettimeofday(&now, nullptr);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void log_writer::go_offline()
+{
+    // A remount that fails half way keeps the original outage start
+    if (storage_online) {
+        offline_since_us = wall_time_us();
+
+        for (auto &chan : channels) {
+            uart_rx_stats rx = {};
+            chan.uart.get_rx_stats(rx);
+            chan.dropped_at_offline = rx.dropped_cnt;
+        }
+    }
+
+    last_remount_us = esp_timer_get_time();
+    storage_online = false;
+    shard_open = false; // Directories have to be created again on whatever card comes back
+    for (auto &chan : channels) {
+        chan.sink.writer.abandon();
+
+        // The line is only skipped for the channel segment if it's still in the block the writer keeps
+        if (chan.pending_in_sink && chan.sink.writer.resend_last_record()) {
+            chan.pending_in_sink = false;
+        }
+    }
+
+    merged.writer.abandon();
+
+    retention_manager::instance()->suspend();
+    sdmmc_manager::instance()->unmount();
+    ESP_LOGE(TAG, "SD card lost, buffering in RAM until it's back");
+}
+
+void log_writer::try_remount()
+{
+    if (esp_timer_get_time() - last_remount_us < REMOUNT_INTERVAL_US) {
+        return;
+    }
+
+    last_remount_us = esp_timer_get_time();
+    auto *sdmmc = sdmmc_manager::instance();
+    if (sdmmc->remount() != ESP_OK) {
+        return;
+    }
+
+    // Segments cut off by the outage may end in a torn block, same as after a power cut
+    segment_journal::instance()->recover();
+    esp_err_t ret = retention_manager::instance()->resume();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Retention not running 0x%x, card will fill up", ret);
+    }
+
+    update_segment_limit();
+
+    int64_t online_us = wall_time_us();
+    uint32_t dropped_total = 0;
+    for (auto &chan : channels) {
+        if (!chan.active) {
+            continue;
+        }
+
+        uart_rx_stats rx = {};
+        chan.uart.get_rx_stats(rx);
+        chan.sink.info.write_batch = sdmmc->get_write_batch_size();
+        dropped_total += rx.dropped_cnt - chan.dropped_at_offline;
+        if (!chan.own_segment) {
+            continue;
+        }
+
+        // A line held back by the outage is written by the next drain, right after the gap marker
+        ret = open_segment(chan.sink);
+        ret = ret ?: chan.sink.writer.write_gap(offline_since_us, online_us, rx.dropped_cnt - chan.dropped_at_offline);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "UART%d: card came back but isn't writable, 0x%x", chan.sink.info.channel, ret);
+            go_offline();
+            return;
+        }
+    }
+
+    if (merge_enabled) {
+        merged.info.write_batch = sdmmc->get_write_batch_size();
+        ret = open_segment(merged);
+        ret = ret ?: merged.writer.write_gap(offline_since_us, online_us, dropped_total);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Merged segment: card came back but isn't writable, 0x%x", ret);
+            go_offline();
+            return;
+        }
+    }
+
+    storage_online = true;
+    last_config_check_us = 0; // The card may have been pulled to edit config.json
+    ESP_LOGI(TAG, "SD card back after %lld ms, flushing backlog", (online_us - offline_since_us) / 1000);
+}
+
+void log_writer::check_sd_health()
+{
+    last_health_check_us = esp_timer_get_time();
+
+    // Look at the last interval only, so a card that starts garbage-collecting shows up quickly
+    sd_write_stats stats = {};
+    sdmmc_manager::instance()->get_write_stats(stats);
+
+    sd_write_stats window = stats;
+    for (size_t idx = 0; idx < sizeof(window.latency_hist) / sizeof(window.latency_hist[0]); idx++) {
+        window.latency_hist[idx] -= last_write_stats.latency_hist[idx];
+    }
+
+    // Catches a pulled card on an idle channel, where no write would notice
+    if (sdmmc_manager::instance()->check_card() != ESP_OK) {
+        go_offline();
+        return;
+    }
+
+    uint32_t new_errors = stats.error_cnt - last_write_stats.error_cnt;
+    uint32_t new_retries = stats.retry_cnt - last_write_stats.retry_cnt;
+    last_write_stats = stats;
+
+    if (new_errors > 0 || new_retries > 0) {
+        ESP_LOGW(TAG, "SD: %lu write error(s), %lu retr(ies) in the last interval", new_errors, new_retries);
+    }
+
+    for (auto &chan : channels) {
+        uart_rx_stats rx = {};
+        chan.uart.get_rx_stats(rx);
+        if (chan.active && rx.spill_depth > 0) {
+            ESP_LOGW(TAG, "UART%d: %lu bytes spilled to PSRAM (peak %lu), %lu line(s) dropped so far",
+                     chan.uart.get_port(), rx.spill_depth, rx.spill_peak, rx.dropped_cnt);
+        }
+    }
+
+    uint32_t p99_us = sdmmc_manager::latency_percentile(window, 990);
+    if (p99_us == 0) {
+        return;
+    }
+
+    // A stall of p99_us at full line rate must still fit in the ring with headroom to spare
+    for (auto &chan : channels) {
+        uint32_t rate = chan.uart.get_ingest_rate();
+        if (!chan.active || rate == 0) {
+            continue;
+        }
+
+        uint64_t stall_bytes = (uint64_t)rate * p99_us / 1000000;
+        uint64_t budget = (uint64_t)chan.uart.get_ring_size() * HEALTH_HEADROOM_PERCENT / 100;
+        if (stall_bytes >= budget) {
+            ESP_LOGW(TAG, "SD p99 write latency %lu us (max %lu us) would fill %llu of %u ring bytes on UART%d; card too slow for this baud rate",
+                     p99_us, stats.max_latency_us, stall_bytes, chan.uart.get_ring_size(), chan.uart.get_port());
+        }
+    }
+}
+
+void log_writer::check_config()
+{
+    last_config_check_us = esp_timer_get_time();
+    auto *cfg = config_loader::instance();
+    if (!cfg->config_changed()) {
+        return;
+    }
+
+    // A config that doesn't load leaves the running one as it is
+    esp_err_t ret = cfg->reload_config();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "config.json changed but can't be loaded 0x%x, keeping the running config", ret);
+        return;
+    }
+
+    uint32_t changes[sizeof(channels) / sizeof(channels[0])] = {};
+    bool any_change = false;
+    for (size_t idx = 0; idx < sizeof(channels) / sizeof(channels[0]); idx++) {
+        changes[idx] = cfg->get_port_changes(channels[idx].uart.get_port());
+        any_change = any_change || changes[idx] != PORT_CHANGE_NONE;
+    }
+
+    if (cfg->needs_restart()) {
+        ESP_LOGW(TAG, "Retention, merge, sniffer or tail settings changed, they take effect on the next boot");
+    }
+
+    uint64_t reserve_bytes = 0;
+    uint64_t segment_bytes = 0;
+    cfg->get_retention_cfg(reserve_bytes, segment_bytes);
+    if (segment_bytes != segment_cfg_size) {
+        segment_cfg_size = segment_bytes;
+        update_segment_limit();
+        any_change = true;
+    }
+
+    if (!any_change) {
+        ESP_LOGI(TAG, "config.json reloaded, nothing to apply");
+        return;
+    }
+
+    // New segments have to describe what they were captured with, the old snapshot goes once nothing points at it
+    char *old_snapshot = cfg_snapshot;
+    cfg_snapshot = nullptr;
+    refresh_snapshot();
+
+    for (size_t idx = 0; idx < sizeof(channels) / sizeof(channels[0]); idx++) {
+        apply_port_changes(channels[idx], changes[idx]);
+    }
+
+    update_merge_window();
+
+    // Changed ports start a new segment, so none mixes lines from before and after; unchanged ones just keep writing
+    merged.info.config = cfg_snapshot;
+    merged.info.config_len = cfg_snapshot_len;
+    for (size_t idx = 0; idx < sizeof(channels) / sizeof(channels[0]); idx++) {
+        log_channel &chan = channels[idx];
+        chan.sink.info.config = cfg_snapshot;
+        chan.sink.info.config_len = cfg_snapshot_len;
+        bool in_place = !(changes[idx] & (PORT_CHANGE_ADDED | PORT_CHANGE_REMOVED));
+        if (changes[idx] != PORT_CHANGE_NONE && in_place && chan.active && chan.own_segment && storage_online) {
+            ret = ret ?: rotate_segment(chan.sink);
+        }
+    }
+
+    if (merge_enabled && storage_online) {
+        ret = ret ?: rotate_segment(merged);
+    }
+
+    heap_caps_free(old_snapshot);
+    if (ret != ESP_OK) {
+        go_offline();
+    }
+}
+
+void log_writer::apply_port_changes(log_channel &chan, uint32_t changes)
+{
+    uart_port_t port = chan.uart.get_port();
+    if (changes == PORT_CHANGE_NONE || (!chan.active && !(changes & PORT_CHANGE_ADDED))) {
+        return;
+    }
+
+    if (changes & PORT_CHANGE_REMOVED) {
+        // Structural: the driver goes away, so everything it captured is written out first
+        chan.uart.stop();
+        while (storage_online && drain_channel(chan) > 0) {
+        }
+
+        chan.active = false;
+        if (chan.own_segment && storage_online) {
+            uint64_t size = chan.sink.writer.get_size();
+            chan.sink.writer.close();
+            retention_manager::instance()->close_segment(chan.sink.info.channel, chan.sink.seg_id, size);
+        }
+
+        ESP_LOGI(TAG, "UART%d removed from config, capture stopped", port);
+        return;
+    }
+
+    if (changes & PORT_CHANGE_ADDED) {
+        esp_err_t ret = init_channel(chan);
+        ESP_LOGI(TAG, "UART%d added to config, 0x%x", port, ret);
+        return;
+    }
+
+    // In place: the ring and the event task keep going, the driver is reconfigured under them
+    if (changes & (PORT_CHANGE_FRAMING | PORT_CHANGE_PINS)) {
+        esp_err_t ret = chan.uart.apply_config(changes);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "UART%d: new settings not applied 0x%x", port, ret);
+        }
+    }
+
+    if (changes & PORT_CHANGE_SINK) {
+        uint64_t quota_bytes = 0;
+        config_loader::instance()->get_sink_cfg(port, chan.sink.info.compress, quota_bytes);
+        retention_manager::instance()->set_quota(chan.sink.info.channel, quota_bytes);
+    }
+}
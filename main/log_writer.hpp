@@ -1,8 +1,33 @@
 #pragma once
 
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "uart_manager.hpp"
 #include "config_loader.hpp"
+#include "segment_writer.hpp"
+#include "sdmmc_manager.hpp"
+
+struct log_sink
+{
+    segment_writer writer;
+    segment_info info = {};
+    uint32_t seg_id = 0;
+};
+
+struct log_channel
+{
+    uart_manager uart;
+    log_sink sink;
+    bool active = false;
+    bool own_segment = true; // Off in sniffer mode, where both directions only go to the merged segment
+    uint8_t *pending_line = nullptr; // Taken from the ring but not written yet, e.g. when the card went away
+    size_t pending_len = 0;
+    int64_t pending_ts_us = 0;
+    bool pending_in_sink = false; // Already in the channel segment, only the merged one is missing it
+    bool pending_published = false; // Already handed to the record bus, a retry after a failed write mustn't repeat it
+    uint32_t dropped_at_offline = 0;
+};
 
 class log_writer
 {
@@ -21,11 +46,76 @@ private:
 
 public:
     esp_err_t init();
+    static void writer_task(void *_ctx);
+
+private:
+    static void card_task(void *_ctx);
+    esp_err_t bring_up_card();
+    bool start_early_capture();
+    esp_err_t init_channel(log_channel &chan, bool stamp_config = true);
+    static uint32_t next_boot_count();
+    void update_segment_limit();
+    void update_merge_window();
+    esp_err_t open_shard();
+    esp_err_t open_segment(log_sink &sink);
+    esp_err_t rotate_segment(log_sink &sink);
+    esp_err_t service_sink(log_sink &sink);
+    static bool peek_line(log_channel &chan);
+    esp_err_t write_line(log_channel &chan);
+    size_t drain_channel(log_channel &chan);
+    size_t drain_merged();
+    void flush_backlog();
+    static int64_t wall_time_us();
+    void check_sd_health();
+    void check_config();
+    void apply_port_changes(log_channel &chan, uint32_t changes);
+    void refresh_snapshot();
+    void go_offline();
+    void try_remount();
 
 private:
-    uart_manager uart1 = uart_manager("uart1_mgr", UART_NUM_1);
-    uart_manager uart2 = uart_manager("uart2_mgr", UART_NUM_2);
+    log_channel channels[2] = {
+            { uart_manager("uart1_mgr", UART_NUM_1), { segment_writer("uart1") } },
+            { uart_manager("uart2_mgr", UART_NUM_2), { segment_writer("uart2") } },
+    };
+
+    log_sink merged = { segment_writer("merged") }; // All channels interleaved by timestamp, when enabled
+    bool merge_enabled = false;
+    bool sniffer = false;
+    int64_t merge_slack_us = 0; // window_ms from the config, covers task and event latency
+    int64_t merge_window_us = 0;
+
+    TaskHandle_t writer_task_handle = nullptr;
+    SemaphoreHandle_t card_ready = nullptr; // Boot only, given by card_task
+    esp_err_t card_ret = ESP_OK;
+    uint32_t boot_id = 0;
+    char *cfg_snapshot = nullptr;
+    size_t cfg_snapshot_len = 0;
+    int64_t last_health_check_us = 0;
+    int64_t last_config_check_us = 0;
+    sd_write_stats last_write_stats = {};
+    uint16_t next_shard = 0;
+    uint16_t cur_shard = 0;
+    uint32_t shard_seg_cnt = 0;
+    int64_t shard_start_us = 0;
+    bool shard_open = false;
+    uint64_t segment_cfg_size = 0;
+    uint64_t segment_max_size = 0;
+    bool storage_online = true;
+    int64_t offline_since_us = 0; // Wall clock, goes into the gap marker
+    int64_t last_remount_us = 0;
 
 private:
+    static const constexpr size_t DRAIN_BATCH = 64;
+    static const constexpr uint64_t SEGMENT_SLACK = 1024 * 1024; // Room for the block and batch in flight when the limit is hit
+    static const constexpr uint32_t WRITER_IDLE_MS = 10;
+    static const constexpr BaseType_t WRITER_CORE = APP_CPU_NUM;
+    static const constexpr int64_t HEALTH_CHECK_INTERVAL_US = 10000000;
+    static const constexpr int64_t REMOUNT_INTERVAL_US = 1000000;
+    static const constexpr int64_t CONFIG_CHECK_INTERVAL_US = 2000000;
+    static const constexpr uint32_t SEGMENTS_PER_SHARD = 128; // Plus as many .idx files
+    static const constexpr int64_t SHARD_INTERVAL_US = 3600LL * 1000000;
+    static const constexpr char NVS_NAMESPACE[] = "soullogger";
+    static const constexpr uint32_t HEALTH_HEADROOM_PERCENT = 50; // Warn once a p99 stall would fill this much of a ring
     static const constexpr char TAG[] = "logger";
 };
@@ -0,0 +1,186 @@
+#include <cstring>
+#include "lz4_codec.hpp"
+
+static inline uint32_t read_u32(const uint8_t *ptr)
+{
+    uint32_t val = 0;
+    memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+static inline uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz4_codec::compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+    if (src == nullptr || dst == nullptr || src_len > MAX_BLOCK_SIZE || dst_cap < compress_bound(src_len)) {
+        return 0;
+    }
+
+    memset(hash_table, 0, sizeof(hash_table));
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *const end = src + src_len;
+    uint8_t *op = dst;
+
+    if (src_len > MF_LIMIT) {
+        const uint8_t *const mf_limit = end - MF_LIMIT;
+        const uint8_t *const match_limit = end - LAST_LITERALS;
+
+        // Position 0 is already "inserted" by the zeroed hash table
+        ip++;
+        while (ip < mf_limit) {
+            uint32_t seq = read_u32(ip);
+            uint32_t hash = (seq * 2654435761U) >> (32 - HASH_BITS);
+            const uint8_t *ref = src + hash_table[hash];
+            hash_table[hash] = (uint16_t)(ip - src);
+
+            if (ref >= ip || read_u32(ref) != seq) {
+                // Step up gradually over incompressible runs so binary garbage doesn't stall the writer
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *match_end = ip + MIN_MATCH;
+            const uint8_t *ref_end = ref + MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+
+            size_t lit_len = ip - anchor;
+            size_t match_len = match_end - ip - MIN_MATCH;
+            auto offset = (uint16_t)(ip - ref);
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+            if (lit_len >= 15) {
+                op = write_length(op, lit_len - 15);
+            }
+
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            *op++ = (uint8_t)(offset & 0xff);
+            *op++ = (uint8_t)(offset >> 8);
+
+            *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+            if (match_len >= 15) {
+                op = write_length(op, match_len - 15);
+            }
+
+            ip = match_end;
+            anchor = ip;
+
+            if (ip < mf_limit) {
+                uint32_t prev_hash = (read_u32(ip - 2) * 2654435761U) >> (32 - HASH_BITS);
+                hash_table[prev_hash] = (uint16_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    // Last sequence is literals only
+    size_t lit_len = end - anchor;
+    *op++ = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) {
+        op = write_length(op, lit_len - 15);
+    }
+
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - dst;
+}
+
+int32_t lz4_codec::decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+    if (src == nullptr || dst == nullptr) {
+        return -1;
+    }
+
+    const uint8_t *ip = src;
+    const uint8_t *const ip_end = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *const op_end = dst + dst_cap;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t len_byte = 0;
+            do {
+                if (ip >= ip_end) {
+                    return -1;
+                }
+
+                len_byte = *ip++;
+                lit_len += len_byte;
+            } while (len_byte == 255);
+        }
+
+        if (lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip >= ip_end) {
+            break; // Last sequence has no match part
+        }
+
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 0x0f;
+        if (match_len == 15) {
+            uint8_t len_byte = 0;
+            do {
+                if (ip >= ip_end) {
+                    return -1;
+                }
+
+                len_byte = *ip++;
+                match_len += len_byte;
+            } while (len_byte == 255);
+        }
+
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        // Byte-wise copy, matches may overlap the output
+        const uint8_t *match = op - offset;
+        for (size_t idx = 0; idx < match_len; idx++) {
+            op[idx] = match[idx];
+        }
+
+        op += match_len;
+    }
+
+    return (int32_t)(op - dst);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// LZ4 block-format codec for independently decodable log blocks.
+// Kept free of ESP-IDF dependencies so the host benchmark can build it as-is.
+class lz4_codec
+{
+public:
+    static constexpr size_t compress_bound(size_t len)
+    {
+        return len + (len / 255) + 16;
+    }
+
+    // Returns compressed size, or 0 if the input is too big or dst is too small
+    size_t compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+    // Returns decompressed size, or -1 on malformed input
+    static int32_t decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+public:
+    static const constexpr size_t MAX_BLOCK_SIZE = 65536;
+
+private:
+    static const constexpr uint32_t HASH_BITS = 12;
+    static const constexpr size_t MIN_MATCH = 4;
+    static const constexpr size_t LAST_LITERALS = 5;
+    static const constexpr size_t MF_LIMIT = 12;
+
+    // Positions are block-relative, so 16 bits are enough for blocks up to 64KB
+    uint16_t hash_table[1U << HASH_BITS] = {};
+};
@@ -0,0 +1,303 @@
+#include <cstring>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include "record_bus.hpp"
+
+esp_err_t record_bus::init()
+{
+    if (pool != nullptr) {
+        return ESP_OK;
+    }
+
+    space = xSemaphoreCreateBinary();
+    pool = (uint8_t *)heap_caps_malloc(MAX_BLOCKS * BLOCK_SIZE, MALLOC_CAP_SPIRAM);
+    if (pool == nullptr || space == nullptr) {
+        ESP_LOGE(TAG, "Can't allocate %lu blocks", MAX_BLOCKS);
+        heap_caps_free(pool);
+        pool = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (uint32_t idx = 0; idx < MAX_BLOCKS; idx++) {
+        free_blocks[idx] = (bus_block *)(pool + idx * BLOCK_SIZE);
+    }
+
+    free_cnt = MAX_BLOCKS;
+    return ESP_OK;
+}
+
+int record_bus::subscribe(const char *name, bus_policy policy)
+{
+    if (pool == nullptr) {
+        return -1;
+    }
+
+    SemaphoreHandle_t ready = xSemaphoreCreateBinary();
+    if (ready == nullptr) {
+        return -1;
+    }
+
+    int sub_id = -1;
+    portENTER_CRITICAL(&lock);
+    for (uint32_t idx = 0; idx < MAX_SUBSCRIBERS; idx++) {
+        if (!subs[idx].in_use) {
+            subs[idx] = { name, true, true, policy, pub_seq, nullptr, ready, {}, false };
+            attached_cnt++;
+            sub_id = (int)idx;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (sub_id < 0) {
+        vSemaphoreDelete(ready);
+        ESP_LOGE(TAG, "No subscriber slot left for %s", name);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "%s subscribed, policy %u", name, policy);
+    return sub_id;
+}
+
+void record_bus::unsubscribe(int sub_id)
+{
+    if (sub_id < 0 || sub_id >= (int)MAX_SUBSCRIBERS) {
+        return;
+    }
+
+    subscriber &sub = subs[sub_id];
+    portENTER_CRITICAL(&lock);
+    if (!sub.in_use) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+
+    if (sub.held != nullptr) {
+        unref(sub.held);
+        sub.held = nullptr;
+    }
+
+    drop_backlog(sub);
+    if (sub.attached) {
+        sub.attached = false;
+        attached_cnt--;
+    }
+
+    SemaphoreHandle_t ready = sub.ready;
+    sub.in_use = false;
+    sub.ready = nullptr;
+    portEXIT_CRITICAL(&lock);
+
+    vSemaphoreDelete(ready);
+    xSemaphoreGive(space);
+}
+
+esp_err_t record_bus::publish(uint8_t channel, const uint8_t *buf, size_t len, int64_t ts_us)
+{
+    // Nobody listening, skip the copy
+    if (attached_cnt == 0 || buf == nullptr) {
+        return ESP_OK;
+    }
+
+    if (bus_record::size_for(len) > BLOCK_CAPACITY) {
+        len = BLOCK_CAPACITY - sizeof(bus_record);
+    }
+
+    size_t rec_size = bus_record::size_for(len);
+    if (cur != nullptr && cur->used + rec_size > BLOCK_CAPACITY) {
+        publish_current();
+    }
+
+    if (cur == nullptr) {
+        cur = take_block();
+        cur->used = 0;
+        cur->record_cnt = 0;
+        cur_start_us = esp_timer_get_time();
+    }
+
+    auto *rec = (bus_record *)((uint8_t *)(cur + 1) + cur->used);
+    rec->ts_us = ts_us;
+    rec->len = (uint16_t)len;
+    rec->channel = channel;
+    memcpy((uint8_t *)(rec + 1), buf, len);
+    cur->used += rec_size;
+    cur->record_cnt++;
+    return ESP_OK;
+}
+
+void record_bus::flush_stale(int64_t now_us)
+{
+    if (cur != nullptr && cur->record_cnt > 0 && now_us - cur_start_us >= BLOCK_MAX_AGE_US) {
+        publish_current();
+    }
+}
+
+const bus_block *record_bus::receive(int sub_id, uint32_t wait_ticks)
+{
+    if (sub_id < 0 || sub_id >= (int)MAX_SUBSCRIBERS) {
+        return nullptr;
+    }
+
+    subscriber &sub = subs[sub_id];
+    do {
+        bus_block *block = nullptr;
+        portENTER_CRITICAL(&lock);
+        bool attached = sub.attached;
+        if (attached && sub.held == nullptr && sub.next_seq != pub_seq) {
+            block = slots[sub.next_seq % MAX_BLOCKS];
+            sub.held = block;
+            sub.next_seq++;
+            sub.stats.blocks_read++;
+        } else if (sub.next_seq == pub_seq) {
+            sub.lagging = false; // Caught up, the publisher waits for it again
+        }
+        portEXIT_CRITICAL(&lock);
+
+        if (block != nullptr || !attached) {
+            return block;
+        }
+    } while (xSemaphoreTake(sub.ready, wait_ticks) == pdTRUE);
+
+    return nullptr;
+}
+
+void record_bus::release(int sub_id)
+{
+    if (sub_id < 0 || sub_id >= (int)MAX_SUBSCRIBERS) {
+        return;
+    }
+
+    subscriber &sub = subs[sub_id];
+    bool freed = false;
+    portENTER_CRITICAL(&lock);
+    if (sub.held != nullptr) {
+        freed = unref(sub.held);
+        sub.held = nullptr;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (freed) {
+        xSemaphoreGive(space);
+    }
+}
+
+void record_bus::get_stats(int sub_id, bus_sub_stats &stats_out)
+{
+    if (sub_id < 0 || sub_id >= (int)MAX_SUBSCRIBERS) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    stats_out = subs[sub_id].stats;
+    portEXIT_CRITICAL(&lock);
+}
+
+void record_bus::publish_current()
+{
+    SemaphoreHandle_t wake[MAX_SUBSCRIBERS] = {};
+    size_t wake_cnt = 0;
+
+    portENTER_CRITICAL(&lock);
+    cur->seq = pub_seq;
+    cur->refs = attached_cnt;
+    slots[pub_seq % MAX_BLOCKS] = cur;
+    pub_seq++;
+    if (cur->refs == 0) {
+        free_blocks[free_cnt++] = cur;
+    }
+
+    for (auto &sub : subs) {
+        if (sub.attached) {
+            wake[wake_cnt++] = sub.ready;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+
+    cur = nullptr;
+    for (size_t idx = 0; idx < wake_cnt; idx++) {
+        xSemaphoreGive(wake[idx]);
+    }
+}
+
+bus_block *record_bus::take_block()
+{
+    while (true) {
+        bus_block *block = nullptr;
+        portENTER_CRITICAL(&lock);
+        if (free_cnt > 0 || make_room()) {
+            block = free_blocks[--free_cnt];
+        }
+        portEXIT_CRITICAL(&lock);
+
+        if (block != nullptr) {
+            return block;
+        }
+
+        // Only subscribers with the block policy are behind, wait for one of them to release or unsubscribe.
+        // The publisher is the card writer, so one wait is all they get; after that they lose blocks until caught up
+        if (xSemaphoreTake(space, pdMS_TO_TICKS(BLOCK_WAIT_MS)) != pdTRUE) {
+            portENTER_CRITICAL(&lock);
+            for (auto &sub : subs) {
+                if (sub.attached && sub.policy == BUS_POLICY_BLOCK && sub.next_seq != pub_seq) {
+                    sub.lagging = true;
+                }
+            }
+            portEXIT_CRITICAL(&lock);
+            ESP_LOGW(TAG, "Publisher held up for %lu ms, blocking subscribers drop blocks until they catch up", BLOCK_WAIT_MS);
+        }
+    }
+}
+
+bool record_bus::make_room()
+{
+    // Called with the lock held. Cut loose the furthest-behind subscriber that allows it, until a block frees up.
+    while (free_cnt == 0) {
+        subscriber *victim = nullptr;
+        for (auto &sub : subs) {
+            if (!sub.attached || (sub.policy == BUS_POLICY_BLOCK && !sub.lagging) || sub.next_seq == pub_seq) {
+                continue;
+            }
+
+            if (victim == nullptr || pub_seq - sub.next_seq > pub_seq - victim->next_seq) {
+                victim = &sub;
+            }
+        }
+
+        if (victim == nullptr) {
+            return false;
+        }
+
+        drop_backlog(*victim);
+        if (victim->policy == BUS_POLICY_DETACH) {
+            victim->attached = false;
+            victim->stats.detached = true;
+            attached_cnt--;
+        }
+    }
+
+    return true;
+}
+
+bool record_bus::unref(bus_block *block)
+{
+    if (--block->refs > 0) {
+        return false;
+    }
+
+    free_blocks[free_cnt++] = block;
+    return true;
+}
+
+void record_bus::drop_backlog(subscriber &sub)
+{
+    if (!sub.attached) {
+        return;
+    }
+
+    while (sub.next_seq != pub_seq) {
+        unref(slots[sub.next_seq % MAX_BLOCKS]);
+        sub.next_seq++;
+        sub.stats.blocks_dropped++;
+    }
+}
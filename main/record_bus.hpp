@@ -0,0 +1,123 @@
+#pragma once
+
+#include <sdkconfig.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// What happens to a subscriber that holds up the whole pool
+enum bus_policy : uint8_t
+{
+    BUS_POLICY_BLOCK = 0, // The publisher waits for it up to BLOCK_WAIT_MS, then drops its blocks until it catches up
+    BUS_POLICY_DROP = 1, // It skips ahead to the newest block
+    BUS_POLICY_DETACH = 2, // It gets no more blocks until it subscribes again
+};
+
+// One captured line, the bytes follow the header, padded to 8
+struct bus_record
+{
+    int64_t ts_us;
+    uint16_t len;
+    uint8_t channel;
+    uint8_t reserved[5];
+
+    const uint8_t *data() const { return (const uint8_t *)(this + 1); }
+    static constexpr size_t size_for(size_t len) { return (sizeof(bus_record) + len + 7) & ~(size_t)7; }
+};
+
+// A pool block full of records, shared read-only by every subscriber until the last one releases it
+struct bus_block
+{
+    uint32_t seq;
+    uint32_t refs; // Subscribers that haven't read and released it yet
+    uint32_t used; // Record bytes after the header
+    uint32_t record_cnt;
+
+    const bus_record *first() const { return record_cnt > 0 ? (const bus_record *)(this + 1) : nullptr; }
+    const bus_record *next(const bus_record *rec) const
+    {
+        auto *pos = (const uint8_t *)rec + bus_record::size_for(rec->len);
+        return pos < (const uint8_t *)(this + 1) + used ? (const bus_record *)pos : nullptr;
+    }
+};
+
+struct bus_sub_stats
+{
+    uint32_t blocks_read;
+    uint32_t blocks_dropped;
+    bool detached;
+};
+
+// Fan-out of captured lines: the writer task copies each line in once, any number of subscribers
+// (console tail, trigger detectors...) read the same blocks with their own cursor.
+// Single publisher; subscribe/receive/release are safe from any task.
+class record_bus
+{
+public:
+    static record_bus *instance()
+    {
+        static record_bus _instance;
+        return &_instance;
+    }
+
+    record_bus(record_bus const &) = delete;
+    void operator=(record_bus const &) = delete;
+
+private:
+    record_bus() = default;
+
+public:
+    esp_err_t init();
+    int subscribe(const char *name, bus_policy policy);
+    void unsubscribe(int sub_id);
+    bool has_subscribers() const { return attached_cnt > 0; }
+    esp_err_t publish(uint8_t channel, const uint8_t *buf, size_t len, int64_t ts_us);
+    void flush_stale(int64_t now_us);
+    const bus_block *receive(int sub_id, uint32_t wait_ticks);
+    void release(int sub_id);
+    void get_stats(int sub_id, bus_sub_stats &stats_out);
+
+public:
+    static const constexpr size_t BLOCK_SIZE = 16384;
+    static const constexpr uint32_t MAX_SUBSCRIBERS = 4;
+    static const constexpr uint32_t MAX_BLOCKS = (CONFIG_SL_FANOUT_POOL_KB * 1024) / BLOCK_SIZE;
+
+private:
+    struct subscriber
+    {
+        const char *name;
+        bool in_use;
+        bool attached;
+        bus_policy policy;
+        uint32_t next_seq;
+        bus_block *held;
+        SemaphoreHandle_t ready;
+        bus_sub_stats stats;
+        bool lagging; // Block policy, but it outlasted BLOCK_WAIT_MS; dropped from like BUS_POLICY_DROP until it catches up
+    };
+
+    void publish_current();
+    bus_block *take_block();
+    bool make_room();
+    bool unref(bus_block *block);
+    void drop_backlog(subscriber &sub);
+
+private:
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t *pool = nullptr;
+    SemaphoreHandle_t space = nullptr;
+    bus_block *free_blocks[MAX_BLOCKS] = {};
+    uint32_t free_cnt = 0;
+    bus_block *slots[MAX_BLOCKS] = {}; // Published blocks by seq, valid from the oldest cursor up to pub_seq
+    uint32_t pub_seq = 0;
+    subscriber subs[MAX_SUBSCRIBERS] = {};
+    uint32_t attached_cnt = 0; // Read unlocked by the publisher to skip the copy, a stale value only costs one line
+    bus_block *cur = nullptr; // Being filled, publisher only
+    int64_t cur_start_us = 0;
+
+private:
+    static const constexpr size_t BLOCK_CAPACITY = BLOCK_SIZE - sizeof(bus_block);
+    static const constexpr int64_t BLOCK_MAX_AGE_US = 50000; // Keeps a live tail live on a quiet line
+    static const constexpr uint32_t BLOCK_WAIT_MS = 1000; // The publisher is the card writer, it can't wait any longer
+    static const constexpr char TAG[] = "record_bus";
+};
@@ -0,0 +1,613 @@
+#include <cstddef>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <esp_heap_caps.h>
+#include "retention_manager.hpp"
+#include "segment_writer.hpp"
+#include "sdmmc_manager.hpp"
+
+esp_err_t retention_manager::init(uint64_t _reserve_bytes, const char *path)
+{
+    reserve_bytes = _reserve_bytes;
+    manifest_path = path;
+
+    lock = xSemaphoreCreateMutex();
+    delete_lock = xSemaphoreCreateMutex();
+    if (lock == nullptr || delete_lock == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (auto &chan : chans) {
+        chan.ring = (segment_entry *)heap_caps_calloc(MAX_SEGMENTS_PER_CHANNEL, sizeof(segment_entry), MALLOC_CAP_SPIRAM);
+        if (chan.ring == nullptr) {
+            ESP_LOGE(TAG, "Can't allocate segment list");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    esp_err_t ret = load_manifest();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ready = true;
+    if (xTaskCreateWithCaps(retention_task, "retention", 8192, this, tskIDLE_PRIORITY + 1, &task_handle, MALLOC_CAP_SPIRAM) != pdPASS) {
+        ESP_LOGE(TAG, "Can't create retention task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void retention_manager::set_quota(uint8_t channel, uint64_t quota_bytes)
+{
+    if (!ready || channel >= MAX_CHANNELS) {
+        return;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    chans[channel].quota_bytes = quota_bytes;
+    xSemaphoreGive(lock);
+}
+
+uint32_t retention_manager::next_segment_id(uint8_t channel)
+{
+    if (!ready || channel >= MAX_CHANNELS) {
+        return 0;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t seg_id = chans[channel].next_id++;
+    xSemaphoreGive(lock);
+    return seg_id;
+}
+
+esp_err_t retention_manager::add_segment(const segment_loc &loc)
+{
+    if (!ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (loc.channel >= MAX_CHANNELS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    segment_entry *entry = push_entry(loc.channel, loc.seg_id, loc.boot, loc.shard);
+    esp_err_t ret = append_record(OP_ADD, loc.channel, *entry);
+    xSemaphoreGive(lock);
+    return ret;
+}
+
+esp_err_t retention_manager::close_segment(uint8_t channel, uint32_t seg_id, uint64_t size)
+{
+    if (!ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (channel >= MAX_CHANNELS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    segment_entry *entry = find_entry(channel, seg_id);
+    if (entry == nullptr) {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (entry->open) {
+        entry->open = false;
+        entry->size = size;
+        chans[channel].total_bytes += size;
+    }
+
+    esp_err_t ret = append_record(OP_CLOSE, channel, *entry);
+    xSemaphoreGive(lock);
+    return ret;
+}
+
+void retention_manager::set_active_shard(uint32_t boot, uint16_t shard)
+{
+    // Called before the writer creates the directory, so reclaim can't remove it between mkdir and the first segment
+    if (!ready) {
+        return;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    active_boot = boot;
+    active_shard = shard;
+    active_valid = true;
+    xSemaphoreGive(lock);
+}
+
+void retention_manager::suspend()
+{
+    if (!ready) {
+        return;
+    }
+
+    // Waits out a delete in flight, so a victim picked from this card is never unlinked on or recorded into the next one
+    xSemaphoreTake(delete_lock, portMAX_DELAY);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (fp != nullptr) {
+        fclose(fp);
+        fp = nullptr;
+    }
+    xSemaphoreGive(lock);
+    xSemaphoreGive(delete_lock);
+}
+
+esp_err_t retention_manager::resume()
+{
+    if (!ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The card may have been swapped, so rebuild everything from whatever manifest it holds
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto &chan : chans) {
+        chan.head = 0;
+        chan.count = 0;
+        chan.next_id = 0;
+        chan.total_bytes = 0;
+    }
+
+    next_gen = 0;
+    record_cnt = 0;
+    esp_err_t ret = load_manifest();
+    xSemaphoreGive(lock);
+    return ret;
+}
+
+void retention_manager::segment_path(const segment_loc &loc, char *out, size_t out_len)
+{
+    // Kept 8.3 so each entry is a single directory slot, even with LFN built in
+    if (loc.boot == LEGACY_BOOT) {
+        snprintf(out, out_len, "/sdcard/u%u_%05lX.slg", loc.channel, loc.seg_id & 0xfffff);
+        return;
+    }
+
+    snprintf(out, out_len, "/sdcard/%08lX/D%04X/u%u_%05lX.slg", loc.boot, loc.shard, loc.channel, loc.seg_id & 0xfffff);
+}
+
+void retention_manager::shard_path(uint32_t boot, uint16_t shard, char *out, size_t out_len)
+{
+    snprintf(out, out_len, "/sdcard/%08lX/D%04X", boot, shard);
+}
+
+void retention_manager::retention_task(void *_ctx)
+{
+    auto *ctx = (retention_manager *)_ctx;
+    while (true) {
+        ctx->reclaim();
+        vTaskDelay(pdMS_TO_TICKS(RECLAIM_INTERVAL_MS));
+    }
+}
+
+void retention_manager::reclaim()
+{
+    for (uint32_t round = 0; round < MAX_DELETES_PER_PASS; round++) {
+        // Unknown until the free space scan is done, only quotas apply meanwhile
+        uint64_t free_bytes = UINT64_MAX;
+        if (reserve_bytes > 0 && sdmmc_manager::instance()->get_free_space(free_bytes) != ESP_OK) {
+            free_bytes = UINT64_MAX;
+        }
+
+        bool need_space = free_bytes < reserve_bytes;
+        uint8_t channel = 0;
+        segment_entry victim = {};
+
+        // Nothing gets deleted while the card is away, the manifest couldn't record it
+        xSemaphoreTake(delete_lock, portMAX_DELAY);
+        xSemaphoreTake(lock, portMAX_DELAY);
+        bool found = fp != nullptr && pick_victim(need_space, channel, victim);
+        xSemaphoreGive(lock);
+
+        if (!found) {
+            xSemaphoreGive(delete_lock);
+            if (need_space && !warned_full) {
+                ESP_LOGW(TAG, "Below reserve (%llu bytes free) with nothing left to reclaim", free_bytes);
+                warned_full = true;
+            }
+
+            return;
+        }
+
+        warned_full = false;
+        delete_segment(channel, victim);
+        xSemaphoreGive(delete_lock);
+    }
+}
+
+bool retention_manager::pick_victim(bool need_space, uint8_t &channel, segment_entry &victim)
+{
+    // Per-channel quotas first, then the globally oldest closed segment if we're short on space
+    int32_t pick = -1;
+    for (uint8_t idx = 0; idx < MAX_CHANNELS; idx++) {
+        channel_state &chan = chans[idx];
+        if (chan.count == 0 || chan.ring[chan.head].open) {
+            continue;
+        }
+
+        bool over_quota = chan.quota_bytes > 0 && chan.total_bytes > chan.quota_bytes;
+        bool full = chan.count >= MAX_SEGMENTS_PER_CHANNEL;
+        if (over_quota || full) {
+            pick = idx;
+            break;
+        }
+
+        if (need_space && (pick < 0 || chan.ring[chan.head].gen < chans[pick].ring[chans[pick].head].gen)) {
+            pick = idx;
+        }
+    }
+
+    if (pick < 0) {
+        return false;
+    }
+
+    channel_state &chan = chans[pick];
+    channel = (uint8_t)pick;
+    victim = chan.ring[chan.head];
+    chan.head = (chan.head + 1) % MAX_SEGMENTS_PER_CHANNEL;
+    chan.count--;
+    chan.total_bytes -= victim.size;
+    return true;
+}
+
+void retention_manager::delete_segment(uint8_t channel, const segment_entry &victim)
+{
+    // Unlink outside the lock, freeing a big cluster chain takes a while and the writer may need to rotate meanwhile.
+    // Only delete_lock is held, which just holds off suspend() until the OP_DEL is in
+    remove_files(channel, victim);
+
+    // Emptied shards and boot directories go too, so the root doesn't fill up over months; these fail while there's anything left.
+    // Each held one cluster. The writer's current shard and boot directory stay, it may be about to create a segment there
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool active_boot_dir = active_valid && victim.boot == active_boot;
+    if (victim.boot != LEGACY_BOOT && !(active_boot_dir && victim.shard == active_shard)) {
+        char path[64] = {};
+        shard_path(victim.boot, victim.shard, path, sizeof(path));
+        if (rmdir(path) == 0) {
+            sdmmc_manager::instance()->release_space(1);
+            *strrchr(path, '/') = '\0';
+            if (!active_boot_dir && rmdir(path) == 0) {
+                sdmmc_manager::instance()->release_space(1);
+            }
+        }
+    }
+
+    // A power cut before this record just means the delete gets retried next boot
+    append_record(OP_DEL, channel, victim);
+    xSemaphoreGive(lock);
+}
+
+void retention_manager::remove_files(uint8_t channel, const segment_entry &victim)
+{
+    char path[64] = {};
+    char idx_path[64] = {};
+    segment_path(make_loc(channel, victim), path, sizeof(path));
+    segment_writer::make_index_path(path, idx_path, sizeof(idx_path));
+
+    if (unlink(path) != 0) {
+        ESP_LOGW(TAG, "%s already gone", path);
+    }
+
+    struct stat st = {};
+    uint64_t idx_size = stat(idx_path, &st) == 0 ? st.st_size : 0;
+    if (unlink(idx_path) == 0) {
+        sdmmc_manager::instance()->release_space(idx_size);
+    }
+
+    sdmmc_manager::instance()->release_space(victim.size);
+    ESP_LOGI(TAG, "Reclaimed %s, %llu bytes", path, victim.size);
+}
+
+void retention_manager::side_path(char *out, size_t out_len) const
+{
+    // Same name with a .new extension, it has to stay a valid 8.3 name like the manifest's own
+    const char *slash = strrchr(manifest_path, '/');
+    const char *dot = strrchr(manifest_path, '.');
+    int base_len = dot != nullptr && (slash == nullptr || dot > slash) ? dot - manifest_path : strlen(manifest_path);
+    snprintf(out, out_len, "%.*s.new", base_len, manifest_path);
+}
+
+esp_err_t retention_manager::load_manifest()
+{
+    // Finish a compaction that got interrupted between unlink and rename
+    char new_path[64] = {};
+    side_path(new_path, sizeof(new_path));
+    struct stat st = {};
+    if (stat(manifest_path, &st) != 0 && stat(new_path, &st) == 0) {
+        rename(new_path, manifest_path);
+    }
+
+    // Anything but current records, i.e. legacy ones or bytes that don't check out, gets the manifest rewritten from
+    // the live set before anything is appended; otherwise new records would land out of step behind them
+    bool rewrite = false;
+    FILE *old_fp = fopen(manifest_path, "rb");
+    if (old_fp != nullptr) {
+        manifest_record rec = {};
+        bool legacy = false;
+        long pos = 0;
+        while (true) {
+            if (read_record(old_fp, rec, legacy)) {
+                apply_record(rec);
+                record_cnt++;
+                rewrite = rewrite || legacy;
+                pos = ftell(old_fp);
+                continue;
+            }
+
+            // A record torn off at the very end would put everything appended behind it out of step as well
+            if (feof(old_fp)) {
+                rewrite = rewrite || ftell(old_fp) != pos;
+                break;
+            }
+
+            // Both record sizes are a multiple of 4, so stepping by that finds the next one
+            ESP_LOGW(TAG, "Skipping torn manifest record at %ld", pos);
+            rewrite = true;
+            pos += sizeof(rec.magic);
+            if (fseek(old_fp, pos, SEEK_SET) != 0) {
+                break;
+            }
+        }
+
+        fclose(old_fp);
+    }
+
+    // Segments still open when power went away have no CLOSE record, take their size from the directory entry
+    uint32_t live_cnt = 0;
+    for (uint8_t idx = 0; idx < MAX_CHANNELS; idx++) {
+        channel_state &chan = chans[idx];
+        for (uint32_t pos = 0; pos < chan.count; pos++) {
+            segment_entry &entry = chan.ring[(chan.head + pos) % MAX_SEGMENTS_PER_CHANNEL];
+            if (entry.open) {
+                char path[64] = {};
+                segment_path(make_loc(idx, entry), path, sizeof(path));
+                entry.size = stat(path, &st) == 0 ? st.st_size : 0;
+                entry.open = false;
+                chan.total_bytes += entry.size;
+            }
+        }
+
+        live_cnt += chan.count;
+    }
+
+    ESP_LOGI(TAG, "Manifest: %lu live segment(s) from %lu record(s)", live_cnt, record_cnt);
+    manifest_size = stat(manifest_path, &st) == 0 ? st.st_size : 0;
+    if (rewrite || record_cnt > live_cnt * 2 + 64) {
+        return compact_manifest();
+    }
+
+    fp = fopen(manifest_path, "ab");
+    return fp != nullptr ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t retention_manager::compact_manifest()
+{
+    if (fp != nullptr) {
+        fclose(fp);
+        fp = nullptr;
+    }
+
+    // Write the live set to a side file first, so a power cut leaves either the old or the new manifest
+    char new_path[64] = {};
+    side_path(new_path, sizeof(new_path));
+    fp = fopen(new_path, "wb");
+    if (fp == nullptr) {
+        return ESP_FAIL;
+    }
+
+    uint64_t old_size = manifest_size;
+    manifest_size = 0;
+    record_cnt = 0;
+    for (uint8_t idx = 0; idx < MAX_CHANNELS; idx++) {
+        channel_state &chan = chans[idx];
+        for (uint32_t pos = 0; pos < chan.count; pos++) {
+            const segment_entry &entry = chan.ring[(chan.head + pos) % MAX_SEGMENTS_PER_CHANNEL];
+            append_record(OP_ADD, idx, entry);
+            if (!entry.open) {
+                append_record(OP_CLOSE, idx, entry);
+            }
+        }
+    }
+
+    fclose(fp);
+    if (unlink(manifest_path) == 0) {
+        sdmmc_manager::instance()->release_space(old_size);
+    }
+
+    if (rename(new_path, manifest_path) != 0) {
+        ESP_LOGE(TAG, "Can't replace manifest");
+    }
+
+    fp = fopen(manifest_path, "ab");
+    return fp != nullptr ? ESP_OK : ESP_FAIL;
+}
+
+bool retention_manager::read_record(FILE *in, manifest_record &rec, bool &legacy)
+{
+    rec = {};
+    legacy = false;
+    if (fread(&rec.magic, sizeof(rec.magic), 1, in) != 1) {
+        return false;
+    }
+
+    if (rec.magic == MANIFEST_MAGIC) {
+        return fread((uint8_t *)&rec + sizeof(rec.magic), sizeof(rec) - sizeof(rec.magic), 1, in) == 1 &&
+               rec.crc == esp_rom_crc32_le(0, (const uint8_t *)&rec, offsetof(manifest_record, crc));
+    }
+
+    if (rec.magic != LEGACY_MAGIC) {
+        return false;
+    }
+
+    legacy_record old = {};
+    old.magic = rec.magic;
+    if (fread((uint8_t *)&old + sizeof(old.magic), sizeof(old) - sizeof(old.magic), 1, in) != 1 ||
+        old.crc != esp_rom_crc32_le(0, (const uint8_t *)&old, offsetof(legacy_record, crc))) {
+        return false;
+    }
+
+    // Kept, so segments written before the upgrade are still reclaimed
+    rec.magic = MANIFEST_MAGIC;
+    rec.op = old.op;
+    rec.channel = old.channel;
+    rec.seg_id = old.seg_id;
+    rec.boot = LEGACY_BOOT;
+    rec.size = old.size;
+    legacy = true;
+    return true;
+}
+
+esp_err_t retention_manager::append_record(uint8_t op, uint8_t channel, const segment_entry &entry)
+{
+    if (fp == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    manifest_record rec = {};
+    rec.magic = MANIFEST_MAGIC;
+    rec.op = op;
+    rec.channel = channel;
+    rec.shard = entry.shard;
+    rec.seg_id = entry.seg_id;
+    rec.boot = entry.boot;
+    rec.size = op == OP_ADD ? 0 : entry.size;
+    rec.crc = esp_rom_crc32_le(0, (const uint8_t *)&rec, offsetof(manifest_record, crc));
+
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1 || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        ESP_LOGE(TAG, "Manifest write failed");
+        return ESP_FAIL;
+    }
+
+    sdmmc_manager::instance()->charge_write(manifest_size, sizeof(rec));
+    manifest_size += sizeof(rec);
+
+    record_cnt++;
+    return ESP_OK;
+}
+
+void retention_manager::apply_record(const manifest_record &rec)
+{
+    if (rec.channel >= MAX_CHANNELS) {
+        return;
+    }
+
+    channel_state &chan = chans[rec.channel];
+    switch (rec.op) {
+        case OP_ADD: {
+            if (find_entry(rec.channel, rec.seg_id) == nullptr) {
+                push_entry(rec.channel, rec.seg_id, rec.boot, rec.shard);
+            }
+
+            if (rec.seg_id >= chan.next_id) {
+                chan.next_id = rec.seg_id + 1;
+            }
+            break;
+        }
+
+        case OP_CLOSE: {
+            segment_entry *entry = find_entry(rec.channel, rec.seg_id);
+            if (entry != nullptr && entry->open) {
+                entry->open = false;
+                entry->size = rec.size;
+                chan.total_bytes += rec.size;
+            }
+            break;
+        }
+
+        case OP_DEL: {
+            remove_entry(rec.channel, rec.seg_id);
+            break;
+        }
+
+        default: {
+            break;
+        }
+    }
+}
+
+retention_manager::segment_entry *retention_manager::find_entry(uint8_t channel, uint32_t seg_id)
+{
+    // Newest first: closes and lookups almost always hit the tail
+    channel_state &chan = chans[channel];
+    for (uint32_t pos = chan.count; pos > 0; pos--) {
+        segment_entry &entry = chan.ring[(chan.head + pos - 1) % MAX_SEGMENTS_PER_CHANNEL];
+        if (entry.seg_id == seg_id) {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+retention_manager::segment_entry *retention_manager::push_entry(uint8_t channel, uint32_t seg_id, uint32_t boot, uint16_t shard)
+{
+    channel_state &chan = chans[channel];
+    if (chan.count >= MAX_SEGMENTS_PER_CHANNEL) {
+        // Only happens if reclaim couldn't keep up; an entry that's forgotten would never be deleted, so delete it now
+        segment_entry victim = chan.ring[chan.head];
+        chan.total_bytes -= victim.size;
+        chan.head = (chan.head + 1) % MAX_SEGMENTS_PER_CHANNEL;
+        chan.count--;
+
+        char path[64] = {};
+        segment_path(make_loc(channel, victim), path, sizeof(path));
+        if (victim.open) {
+            ESP_LOGE(TAG, "Segment list for channel %u full, %s is still open and no longer tracked", channel, path);
+        } else {
+            ESP_LOGW(TAG, "Segment list for channel %u full, deleting %s early", channel, path);
+            remove_files(channel, victim);
+            append_record(OP_DEL, channel, victim);
+        }
+    }
+
+    segment_entry &entry = chan.ring[(chan.head + chan.count) % MAX_SEGMENTS_PER_CHANNEL];
+    entry.seg_id = seg_id;
+    entry.gen = next_gen++;
+    entry.boot = boot;
+    entry.shard = shard;
+    entry.open = true;
+    entry.size = 0;
+    chan.count++;
+    return &entry;
+}
+
+bool retention_manager::remove_entry(uint8_t channel, uint32_t seg_id)
+{
+    channel_state &chan = chans[channel];
+    if (chan.count == 0) {
+        return false;
+    }
+
+    // Deletes go oldest first, so this is the head in practice
+    if (chan.ring[chan.head].seg_id == seg_id) {
+        chan.total_bytes -= chan.ring[chan.head].size;
+        chan.head = (chan.head + 1) % MAX_SEGMENTS_PER_CHANNEL;
+        chan.count--;
+        return true;
+    }
+
+    for (uint32_t pos = 1; pos < chan.count; pos++) {
+        uint32_t slot = (chan.head + pos) % MAX_SEGMENTS_PER_CHANNEL;
+        if (chan.ring[slot].seg_id != seg_id) {
+            continue;
+        }
+
+        chan.total_bytes -= chan.ring[slot].size;
+        for (; pos + 1 < chan.count; pos++) {
+            chan.ring[(chan.head + pos) % MAX_SEGMENTS_PER_CHANNEL] = chan.ring[(chan.head + pos + 1) % MAX_SEGMENTS_PER_CHANNEL];
+        }
+
+        chan.count--;
+        return true;
+    }
+
+    return false;
+}
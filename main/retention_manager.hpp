@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdio>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "log_format.hpp"
+
+// Where a segment lives on the card: /sdcard/<boot>/D<shard>/u<channel>_<seg_id>.slg
+struct segment_loc
+{
+    uint8_t channel;
+    uint16_t shard;
+    uint32_t boot;
+    uint32_t seg_id;
+};
+
+// Keeps a free-space reserve by deleting the oldest segments, tracked in an append-only manifest on the card
+class retention_manager
+{
+public:
+    static retention_manager *instance()
+    {
+        static retention_manager _instance;
+        return &_instance;
+    }
+
+    retention_manager(retention_manager const &) = delete;
+    void operator=(retention_manager const &) = delete;
+
+private:
+    retention_manager() = default;
+
+public:
+    esp_err_t init(uint64_t _reserve_bytes, const char *path = "/sdcard/manifest.bin");
+    void set_quota(uint8_t channel, uint64_t quota_bytes);
+    uint32_t next_segment_id(uint8_t channel);
+    esp_err_t add_segment(const segment_loc &loc);
+    esp_err_t close_segment(uint8_t channel, uint32_t seg_id, uint64_t size);
+    void set_active_shard(uint32_t boot, uint16_t shard);
+    void suspend();
+    esp_err_t resume();
+    static void segment_path(const segment_loc &loc, char *out, size_t out_len);
+    static void shard_path(uint32_t boot, uint16_t shard, char *out, size_t out_len);
+    static void retention_task(void *_ctx);
+
+public:
+    static const constexpr uint8_t MAX_CHANNELS = log_format::MERGED_CHANNEL + 1; // UARTs plus the merged segment
+
+private:
+    struct segment_entry
+    {
+        uint32_t seg_id;
+        uint32_t gen; // Global creation order, to find the oldest across channels
+        uint32_t boot;
+        uint16_t shard;
+        bool open;
+        uint64_t size;
+    };
+
+    struct channel_state
+    {
+        segment_entry *ring;
+        uint32_t head;
+        uint32_t count;
+        uint32_t next_id;
+        uint64_t total_bytes;
+        uint64_t quota_bytes;
+    };
+
+    enum manifest_op : uint8_t
+    {
+        OP_ADD = 1,
+        OP_CLOSE = 2,
+        OP_DEL = 3,
+    };
+
+    struct __attribute__((packed)) manifest_record
+    {
+        uint32_t magic;
+        uint8_t op;
+        uint8_t channel;
+        uint16_t shard;
+        uint32_t seg_id;
+        uint32_t boot;
+        uint32_t reserved;
+        uint64_t size;
+        uint32_t crc;
+    };
+
+    static_assert(sizeof(manifest_record) == 32, "manifest_record layout changed");
+
+    // Before boot and shard were recorded, segments sat in the root directory
+    struct __attribute__((packed)) legacy_record
+    {
+        uint32_t magic;
+        uint8_t op;
+        uint8_t channel;
+        uint16_t reserved;
+        uint32_t seg_id;
+        uint64_t size;
+        uint32_t crc;
+    };
+
+    static_assert(sizeof(legacy_record) == 24, "legacy_record layout changed");
+
+    void side_path(char *out, size_t out_len) const;
+    esp_err_t load_manifest();
+    esp_err_t compact_manifest();
+    bool read_record(FILE *in, manifest_record &rec, bool &legacy);
+    esp_err_t append_record(uint8_t op, uint8_t channel, const segment_entry &entry);
+    void apply_record(const manifest_record &rec);
+    segment_entry *find_entry(uint8_t channel, uint32_t seg_id);
+    segment_entry *push_entry(uint8_t channel, uint32_t seg_id, uint32_t boot, uint16_t shard);
+    bool remove_entry(uint8_t channel, uint32_t seg_id);
+    bool pick_victim(bool need_space, uint8_t &channel, segment_entry &victim);
+    void delete_segment(uint8_t channel, const segment_entry &victim);
+    void remove_files(uint8_t channel, const segment_entry &victim);
+    static segment_loc make_loc(uint8_t channel, const segment_entry &entry) { return { channel, entry.shard, entry.boot, entry.seg_id }; }
+    void reclaim();
+
+private:
+    const char *manifest_path = nullptr;
+    FILE *fp = nullptr;
+    uint64_t manifest_size = 0;
+    SemaphoreHandle_t lock = nullptr;
+    SemaphoreHandle_t delete_lock = nullptr; // Held from picking a victim until its OP_DEL is recorded, taken before lock
+    TaskHandle_t task_handle = nullptr;
+    channel_state chans[MAX_CHANNELS] = {};
+    uint64_t reserve_bytes = 0;
+    uint32_t next_gen = 0;
+    uint32_t record_cnt = 0;
+    bool warned_full = false;
+    uint32_t active_boot = 0; // Shard the writer creates segments in, never removed even while it's empty
+    uint16_t active_shard = 0;
+    bool active_valid = false;
+    bool ready = false; // Set once init got as far as a usable manifest, everything else is a no-op before that
+
+private:
+    static const constexpr uint32_t MANIFEST_MAGIC = 0x324d4c53; // "SLM2"
+    static const constexpr uint32_t LEGACY_MAGIC = 0x4d474c53; // "SLGM"
+    static const constexpr uint32_t LEGACY_BOOT = 0; // Boot counts start at 1, so this marks a pre-shard segment
+    static const constexpr uint32_t MAX_SEGMENTS_PER_CHANNEL = 4096;
+    static const constexpr uint32_t MAX_DELETES_PER_PASS = 16;
+    static const constexpr uint32_t RECLAIM_INTERVAL_MS = 5000;
+    static const constexpr char TAG[] = "retention";
+};
@@ -1,8 +1,19 @@
 #include <sdmmc_cmd.h>
+#include <sd_protocol_defs.h>
 #include <cstring>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include "ArduinoJson.hpp"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include "sdmmc_manager.hpp"
 
+// config.json, boot_timing.csv(.old) and config.bin.tmp aren't 8.3 names, FatFs rejects them with FR_INVALID_NAME
+// unless long file names are built in. Segments and the manifest stay 8.3 regardless
+#ifdef CONFIG_FATFS_LFN_NONE
+#error "SD file names need long file name support, set CONFIG_FATFS_LFN_HEAP"
+#endif
+
 esp_err_t sdmmc_manager::init(const char *path)
 {
     ESP_LOGI(TAG, "Init start");
@@ -17,20 +28,600 @@ esp_err_t sdmmc_manager::init(const char *path)
     slot_cfg.d2 = PIN_D2;
     slot_cfg.d3 = PIN_D3;
 
-    auto ret = esp_vfs_fat_sdmmc_mount(path, &host_cfg, &slot_cfg, &mount_cfg, &card);
+    scan_lock = xSemaphoreCreateMutex();
+    if (scan_lock == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // A card that was mid-write at power loss often just needs a second go (e.g. still busy internally)
+    esp_err_t ret = ESP_FAIL;
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t attempt = 0; attempt < MOUNT_RETRY_CNT; attempt++) {
+        ret = esp_vfs_fat_sdmmc_mount(path, &host_cfg, &slot_cfg, &mount_cfg, &card);
+        if (ret == ESP_OK) {
+            break;
+        }
+
+        ESP_LOGW(TAG, "Mount attempt %lu failed, ret=0x%x", attempt + 1, ret);
+        vTaskDelay(pdMS_TO_TICKS(MOUNT_RETRY_DELAY_MS));
+    }
+
+#ifdef CONFIG_SL_SD_FORMAT_UNREADABLE
+    // Streaming logs want big clusters: fewer FAT updates per MB and whole-AU writes
+    if (ret == ESP_FAIL) {
+        ESP_LOGW(TAG, "No usable filesystem, formatting with %u KB clusters", FORMAT_CLUSTER_SIZE / 1024);
+        esp_vfs_fat_sdmmc_mount_config_t format_cfg = mount_cfg;
+        format_cfg.format_if_mount_failed = true;
+        format_cfg.allocation_unit_size = FORMAT_CLUSTER_SIZE;
+        ret = esp_vfs_fat_sdmmc_mount(path, &host_cfg, &slot_cfg, &format_cfg, &card);
+    }
+#endif
+
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to mount SD card, ret=0x%x", ret);
+        ESP_LOGE(TAG, "Failed to mount SD card, ret=0x%x; card left untouched. exFAT isn't built in, SDXC cards need FAT32", ret);
         return ret;
     }
 
+    int64_t mount_us = esp_timer_get_time() - start_us;
+    mount_path = path;
+
+    probe_card();
+    ESP_LOGI(TAG, "Init OK, %s mounted in %lld ms, write batch %u bytes",
+             fs_name(fs_type), mount_us / 1000, get_write_batch_size());
+    return ret;
+}
+
+const char *sdmmc_manager::fs_name(sd_fs_type type)
+{
+    switch (type) {
+        case SD_FS_FAT16:
+            return "FAT16";
+        case SD_FS_FAT32:
+            return "FAT32";
+        default:
+            return "unknown fs";
+    }
+}
+
+void sdmmc_manager::print_info()
+{
+    // Writes to stdout line by line, slow enough to keep out of the boot path
     if (card != nullptr) {
         sdmmc_card_print_info(stdout, card);
     }
+}
+
+uint64_t sdmmc_manager::get_max_file_size() const
+{
+    // FAT stops at 4GB, but offsets go through newlib's off_t in the VFS, which is 32-bit here: 2GB in practice
+    uint64_t off_max = sizeof(off_t) >= sizeof(uint64_t) ? INT64_MAX : INT32_MAX;
+    uint64_t fs_max = UINT32_MAX;
+    return fs_max < off_max ? fs_max : off_max;
+}
+
+esp_err_t sdmmc_manager::remount()
+{
+    if (mount_path == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (card != nullptr) {
+        return ESP_OK;
+    }
+
+    esp_err_t ret = esp_vfs_fat_sdmmc_mount(mount_path, &host_cfg, &slot_cfg, &mount_cfg, &card);
+    if (ret != ESP_OK) {
+        card = nullptr;
+        return ret;
+    }
+
+    // Could be a different card, so everything learned about the old one goes
+    sd_status = {};
+    fs_type = SD_FS_UNKNOWN;
+    cluster_size = 0;
+    fat_start_sector = 0;
+    fsinfo_sector = 0;
+    probe_card();
+    ESP_LOGI(TAG, "Card back, write batch %u bytes", get_write_batch_size());
+    return ESP_OK;
+}
+
+void sdmmc_manager::unmount()
+{
+    if (card == nullptr) {
+        return;
+    }
+
+    // Waits out a free space scan read in flight, the next one sees the new generation and stops
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&stats_lock);
+    free_space_valid = false;
+    mount_gen++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    // The card may already be gone, this mostly tears down the VFS and host state so a later mount starts clean
+    esp_err_t ret = esp_vfs_fat_sdcard_unmount(mount_path, card);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Unmount returned 0x%x", ret);
+    }
+
+    card = nullptr;
+    xSemaphoreGive(scan_lock);
+}
+
+esp_err_t sdmmc_manager::check_card()
+{
+    if (card == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return sdmmc_get_status(card);
+}
+
+void sdmmc_manager::probe_card()
+{
+    if (read_sd_status() == ESP_OK) {
+        ESP_LOGI(TAG, "AU %lu KB, speed class %u, UHS grade %u, video class V%u",
+                 sd_status.au_size_kb, sd_status.speed_class, sd_status.uhs_grade, sd_status.video_class);
+    }
+
+    // Clusters are fixed at format time, all that's left to do here is flag a bad layout
+    check_fs_alignment();
+    seed_free_space();
+}
+
+size_t sdmmc_manager::get_write_batch_size() const
+{
+    // Batches are a power of two dividing the AU, so an aligned batch never straddles an AU boundary
+    if (sd_status.au_size_kb == 0) {
+        return DEFAULT_WRITE_BATCH;
+    }
+
+    size_t batch = MAX_WRITE_BATCH;
+    while (batch > SECTOR_SIZE && (sd_status.au_size_kb * 1024) % batch != 0) {
+        batch /= 2;
+    }
+
+    return batch;
+}
+
+esp_err_t sdmmc_manager::get_free_space(uint64_t &free_bytes)
+{
+    portENTER_CRITICAL(&stats_lock);
+    bool valid = free_space_valid;
+    free_bytes = free_bytes_cached;
+    portEXIT_CRITICAL(&stats_lock);
+    return valid ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+uint64_t sdmmc_manager::cluster_bytes(uint64_t size) const
+{
+    // FAT hands out whole clusters, so a file of any size but 0 takes at least one
+    return cluster_size > 0 ? (size + cluster_size - 1) / cluster_size * cluster_size : size;
+}
+
+void sdmmc_manager::charge_write(uint64_t offset, size_t len)
+{
+    // Appends only: a write within the clusters the file already has costs nothing
+    adjust_free_space(-(int64_t)(cluster_bytes(offset + len) - cluster_bytes(offset)));
+}
+
+void sdmmc_manager::release_space(uint64_t old_size, uint64_t new_size)
+{
+    // A file shrinking from old_size to new_size, new_size 0 being a delete
+    if (new_size < old_size) {
+        adjust_free_space((int64_t)(cluster_bytes(old_size) - cluster_bytes(new_size)));
+    }
+}
+
+void sdmmc_manager::adjust_free_space(int64_t delta)
+{
+    portENTER_CRITICAL(&stats_lock);
+    if (delta < 0 && free_bytes_cached < (uint64_t)-delta) {
+        free_bytes_cached = 0;
+    } else {
+        free_bytes_cached += delta;
+    }
+
+    free_scan_delta += delta;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+esp_err_t sdmmc_manager::seed_free_space()
+{
+    // FSINFO's free count is only a hint, take it when it's plausible and fall back to one scan otherwise
+    if (card != nullptr && fsinfo_sector != 0 && cluster_size > 0) {
+        auto *sector = (uint8_t *)heap_caps_malloc(SECTOR_SIZE, MALLOC_CAP_DMA);
+        if (sector == nullptr) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        uint32_t lead_sig = 0, struct_sig = 0, free_cnt = UINT32_MAX;
+        if (sdmmc_read_sectors(card, sector, fsinfo_sector, 1) == ESP_OK) {
+            memcpy(&lead_sig, sector, sizeof(lead_sig));
+            memcpy(&struct_sig, sector + 484, sizeof(struct_sig));
+            memcpy(&free_cnt, sector + 488, sizeof(free_cnt));
+        }
+
+        heap_caps_free(sector);
+        if (lead_sig == FSINFO_LEAD_SIG && struct_sig == FSINFO_STRUCT_SIG && free_cnt <= cluster_cnt) {
+            portENTER_CRITICAL(&stats_lock);
+            free_bytes_cached = (uint64_t)free_cnt * cluster_size;
+            free_space_valid = true;
+            portEXIT_CRITICAL(&stats_lock);
+            ESP_LOGI(TAG, "Free space from FSINFO: %llu MB", free_bytes_cached / (1024 * 1024));
+            return ESP_OK;
+        }
+    }
+
+    // FAT12 isn't decoded, only quotas apply there
+    if (card == nullptr || fat_start_sector == 0 || cluster_cnt < FAT16_MIN_CLUSTERS) {
+        ESP_LOGW(TAG, "No usable FSINFO and no FAT to scan, free space unknown");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // A scan still running from before a remount starts over by itself
+    portENTER_CRITICAL(&stats_lock);
+    bool running = free_scan_running;
+    free_scan_running = true;
+    portEXIT_CRITICAL(&stats_lock);
+    if (running) {
+        return ESP_OK;
+    }
+
+    // A full FAT walk takes seconds on big cards, don't hold up boot for it
+    ESP_LOGI(TAG, "No usable FSINFO, scanning FAT in the background");
+    if (xTaskCreateWithCaps(free_scan_task, "sd_free_scan", 4096, this, tskIDLE_PRIORITY + 1, nullptr, MALLOC_CAP_SPIRAM) != pdPASS) {
+        ESP_LOGE(TAG, "Can't create free space scan task");
+        portENTER_CRITICAL(&stats_lock);
+        free_scan_running = false;
+        portEXIT_CRITICAL(&stats_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void sdmmc_manager::free_scan_task(void *_ctx)
+{
+    auto *ctx = (sdmmc_manager *)_ctx;
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+    while (ret == ESP_ERR_INVALID_STATE) {
+        portENTER_CRITICAL(&ctx->stats_lock);
+        uint32_t gen = ctx->mount_gen;
+        ctx->free_scan_delta = 0;
+        portEXIT_CRITICAL(&ctx->stats_lock);
+
+        int64_t start_us = esp_timer_get_time();
+        uint32_t free_cnt = 0;
+        ret = ctx->scan_free_clusters(gen, free_cnt);
+        if (ret == ESP_OK) {
+            // Writes and deletes during the scan are counted on top; one landing in an already scanned part of the FAT
+            // is right, one landing ahead of the scan is counted twice, so this errs on the low side until the next mount
+            portENTER_CRITICAL(&ctx->stats_lock);
+            int64_t free_bytes = (int64_t)free_cnt * ctx->cluster_size + ctx->free_scan_delta;
+            ctx->free_bytes_cached = free_bytes > 0 ? free_bytes : 0;
+            ctx->free_space_valid = ctx->mount_gen == gen;
+            portEXIT_CRITICAL(&ctx->stats_lock);
+            ESP_LOGI(TAG, "Free space scan: %llu MB free, took %lld ms", ctx->free_bytes_cached / (1024 * 1024), (esp_timer_get_time() - start_us) / 1000);
+        } else if (ret == ESP_ERR_INVALID_STATE) {
+            // Unmounted under us: wait for the card to come back, then go again with whatever it holds
+            while (!ctx->is_mounted() || ctx->fat_start_sector == 0) {
+                vTaskDelay(pdMS_TO_TICKS(1000));
+            }
+        } else {
+            ESP_LOGE(TAG, "Free space scan failed 0x%x", ret);
+        }
+    }
 
-    ESP_LOGI(TAG, "Init OK");
+    portENTER_CRITICAL(&ctx->stats_lock);
+    ctx->free_scan_running = false;
+    portEXIT_CRITICAL(&ctx->stats_lock);
+    vTaskDeleteWithCaps(nullptr);
+}
+
+esp_err_t sdmmc_manager::scan_free_clusters(uint32_t gen, uint32_t &free_cnt)
+{
+    // Reads the FAT straight off the card a few sectors at a time, so FatFs is never locked for the walk
+    // and the writer gets the bus between steps
+    auto *buf = (uint8_t *)heap_caps_malloc(FREE_SCAN_SECTORS * SECTOR_SIZE, MALLOC_CAP_DMA);
+    if (buf == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint32_t entry_size = fs_type == SD_FS_FAT32 ? 4 : 2;
+    uint32_t entries_per_step = FREE_SCAN_SECTORS * SECTOR_SIZE / entry_size;
+    uint32_t entry_end = cluster_cnt + 2; // Entries 0 and 1 are reserved
+    esp_err_t ret = ESP_OK;
+    free_cnt = 0;
+
+    for (uint32_t first = 0; first < entry_end && ret == ESP_OK; first += entries_per_step) {
+        uint32_t cnt = entry_end - first < entries_per_step ? entry_end - first : entries_per_step;
+        size_t sector_cnt = ((size_t)cnt * entry_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+        xSemaphoreTake(scan_lock, portMAX_DELAY);
+        if (card == nullptr || mount_gen != gen) {
+            ret = ESP_ERR_INVALID_STATE;
+        } else {
+            ret = sdmmc_read_sectors(card, buf, fat_start_sector + (uint64_t)first * entry_size / SECTOR_SIZE, sector_cnt);
+        }
+        xSemaphoreGive(scan_lock);
+
+        for (uint32_t idx = first < 2 ? 2 : first; ret == ESP_OK && idx < first + cnt; idx++) {
+            uint32_t entry = 0;
+            memcpy(&entry, buf + (idx - first) * entry_size, entry_size);
+            if ((entry_size == 4 ? entry & 0x0fffffff : entry) == 0) {
+                free_cnt++;
+            }
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(FREE_SCAN_STEP_DELAY_MS));
+    }
+
+    heap_caps_free(buf);
     return ret;
 }
 
+void sdmmc_manager::record_write(size_t len, int64_t elapsed_us, bool success)
+{
+    uint32_t bucket = 0;
+    while (bucket < (sizeof(write_stats.latency_hist) / sizeof(write_stats.latency_hist[0])) - 1 && elapsed_us >= (2LL << bucket)) {
+        bucket++;
+    }
+
+    int64_t now_sec = esp_timer_get_time() / 1000000;
+    const uint32_t slot_cnt = sizeof(write_stats.throughput_hist) / sizeof(write_stats.throughput_hist[0]);
+
+    portENTER_CRITICAL(&stats_lock);
+    write_stats.latency_hist[bucket]++;
+    write_stats.write_cnt++;
+    if (elapsed_us > write_stats.max_latency_us) {
+        write_stats.max_latency_us = (uint32_t)elapsed_us;
+    }
+
+    if (!success) {
+        write_stats.error_cnt++;
+    } else {
+        write_stats.bytes_written += len;
+    }
+
+    // Advance the per-second throughput ring, zeroing any seconds without writes
+    for (int64_t sec = throughput_sec; sec < now_sec && sec - throughput_sec < slot_cnt; sec++) {
+        write_stats.throughput_head = (write_stats.throughput_head + 1) % slot_cnt;
+        write_stats.throughput_hist[write_stats.throughput_head] = 0;
+    }
+
+    throughput_sec = now_sec;
+    if (success) {
+        write_stats.throughput_hist[write_stats.throughput_head] += len;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void sdmmc_manager::record_retry()
+{
+    portENTER_CRITICAL(&stats_lock);
+    write_stats.retry_cnt++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void sdmmc_manager::get_write_stats(sd_write_stats &stats_out)
+{
+    portENTER_CRITICAL(&stats_lock);
+    stats_out = write_stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+uint32_t sdmmc_manager::latency_percentile(const sd_write_stats &stats, uint32_t permille)
+{
+    const uint32_t bucket_cnt = sizeof(stats.latency_hist) / sizeof(stats.latency_hist[0]);
+    uint64_t total = 0;
+    for (uint32_t idx = 0; idx < bucket_cnt; idx++) {
+        total += stats.latency_hist[idx];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    // Upper edge of the bucket holding the percentile, so this errs on the slow side
+    uint64_t target = (total * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t idx = 0; idx < bucket_cnt; idx++) {
+        seen += stats.latency_hist[idx];
+        if (seen >= target) {
+            return 2UL << idx;
+        }
+    }
+
+    return 2UL << (bucket_cnt - 1);
+}
+
+esp_err_t sdmmc_manager::read_sd_status()
+{
+    if (card == nullptr || card->is_mmc || card->is_sdio) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // ACMD13 returns the 512-bit SD Status; IDF only keeps part of it in card->ssr
+    auto *buf = (uint8_t *)heap_caps_calloc(1, 64, MALLOC_CAP_DMA);
+    if (buf == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    sdmmc_command_t app_cmd = {};
+    app_cmd.opcode = MMC_APP_CMD;
+    app_cmd.arg = MMC_ARG_RCA(card->rca);
+    app_cmd.flags = SCF_CMD_AC | SCF_RSP_R1;
+
+    sdmmc_command_t status_cmd = {};
+    status_cmd.opcode = SD_APP_SD_STATUS;
+    status_cmd.flags = SCF_CMD_ADTC | SCF_CMD_READ | SCF_RSP_R1;
+    status_cmd.data = buf;
+    status_cmd.datalen = 64;
+    status_cmd.blklen = 64;
+
+    esp_err_t ret = card->host.do_transaction(card->host.slot, &app_cmd);
+    ret = ret ?: card->host.do_transaction(card->host.slot, &status_cmd);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Can't read SD Status, ret=0x%x; using decoded SSR", ret);
+        sd_status.au_size_kb = card->ssr.alloc_unit_kb;
+        sd_status.erase_size_au = card->ssr.erase_size_au;
+        heap_caps_free(buf);
+        return ret;
+    }
+
+    // Big-endian bitfield, bit 511 is the MSB of byte 0
+    static const uint32_t au_kb_table[] = { 0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096,
+                                            8192, 12288, 16384, 24576, 32768, 65536 };
+    static const uint8_t speed_class_table[] = { 0, 2, 4, 6, 10 };
+
+    uint8_t speed_class = buf[8];
+    sd_status.speed_class = speed_class < sizeof(speed_class_table) ? speed_class_table[speed_class] : 0;
+    sd_status.au_size_kb = au_kb_table[buf[10] >> 4];
+    sd_status.erase_size_au = (uint16_t)((buf[11] << 8) | buf[12]);
+    sd_status.uhs_grade = buf[14] >> 4;
+    sd_status.video_class = buf[15];
+
+    // UHS cards may report their AU in a separate field instead
+    if (sd_status.au_size_kb == 0 && (buf[14] & 0x0f) != 0) {
+        sd_status.au_size_kb = au_kb_table[buf[14] & 0x0f];
+    }
+
+    heap_caps_free(buf);
+    return ESP_OK;
+}
+
+esp_err_t sdmmc_manager::check_fs_alignment()
+{
+    if (card == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    auto *sector = (uint8_t *)heap_caps_malloc(SECTOR_SIZE, MALLOC_CAP_DMA);
+    if (sector == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // MBR partition 1 start, or 0 for a superfloppy layout
+    uint32_t part_start = 0;
+    esp_err_t ret = sdmmc_read_sectors(card, sector, 0, 1);
+    if (ret == ESP_OK && sector[510] == 0x55 && sector[511] == 0xaa && sector[0] != 0xeb && sector[0] != 0xe9) {
+        memcpy(&part_start, sector + 446 + 8, sizeof(part_start));
+    }
+
+    ret = ret ?: sdmmc_read_sectors(card, sector, part_start, 1);
+    if (ret != ESP_OK) {
+        heap_caps_free(sector);
+        return ret;
+    }
+
+    uint16_t bytes_per_sector = sector[11] | (sector[12] << 8);
+    uint8_t sectors_per_cluster = sector[13];
+    uint16_t reserved = sector[14] | (sector[15] << 8);
+    uint8_t fat_cnt = sector[16];
+    uint16_t root_entries = sector[17] | (sector[18] << 8);
+    uint32_t total_sectors = sector[19] | (sector[20] << 8);
+    uint32_t fat_size = sector[22] | (sector[23] << 8);
+    uint16_t fsinfo_rel = 0;
+    if (total_sectors == 0) {
+        memcpy(&total_sectors, sector + 32, sizeof(total_sectors));
+    }
+
+    // Only FAT32 leaves the 16-bit FAT size at 0 and has the extended BPB with FSINFO
+    fs_type = fat_size != 0 ? SD_FS_FAT16 : SD_FS_FAT32;
+    if (fs_type == SD_FS_FAT32) {
+        memcpy(&fat_size, sector + 36, sizeof(fat_size));
+        fsinfo_rel = sector[48] | (sector[49] << 8);
+    }
+    heap_caps_free(sector);
+
+    if (bytes_per_sector != SECTOR_SIZE || sectors_per_cluster == 0) {
+        ESP_LOGW(TAG, "Not a FAT volume, skipping alignment check");
+        fs_type = SD_FS_UNKNOWN;
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // FAT12/16 keep a fixed root directory between the FATs and the data area
+    uint32_t root_dir_sectors = ((uint32_t)root_entries * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    cluster_size = bytes_per_sector * sectors_per_cluster;
+    fat_start_sector = (uint64_t)part_start + reserved;
+    data_start_sector = fat_start_sector + (uint64_t)fat_cnt * fat_size + root_dir_sectors;
+    cluster_cnt = (uint32_t)((part_start + (uint64_t)total_sectors - data_start_sector) / sectors_per_cluster);
+    fsinfo_sector = (fsinfo_rel != 0 && fsinfo_rel != 0xffff) ? part_start + fsinfo_rel : 0;
+
+    return check_data_alignment();
+}
+
+esp_err_t sdmmc_manager::check_data_alignment()
+{
+    uint64_t au_bytes = (uint64_t)sd_status.au_size_kb * 1024;
+    uint64_t data_start = data_start_sector * SECTOR_SIZE;
+    if (au_bytes > 0 && data_start % au_bytes != 0) {
+        ESP_LOGW(TAG, "Cluster heap at sector %llu isn't aligned to the %llu KB AU, card will do read-modify-write; reformat with an aligned layout",
+                 data_start_sector, au_bytes / 1024);
+    }
+
+    ESP_LOGI(TAG, "Cluster %lu bytes, data area at sector %llu", cluster_size, data_start_sector);
+    return ESP_OK;
+}
+
+#ifdef CONFIG_SL_SD_BENCH_AT_BOOT
+esp_err_t sdmmc_manager::run_write_bench(const char *path)
+{
+    static const size_t chunk_sizes[] = { 4096, 16384, 65536, MAX_WRITE_BATCH };
+    static const size_t BENCH_FILE_SIZE = 8 * 1024 * 1024;
+
+    auto *buf = (uint8_t *)heap_caps_malloc(MAX_WRITE_BATCH + SECTOR_SIZE, MALLOC_CAP_SPIRAM);
+    if (buf == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(buf, 0x5a, MAX_WRITE_BATCH + SECTOR_SIZE);
+    ESP_LOGI(TAG, "Write bench: %s, cluster %lu, AU %lu KB, class %u, batch %u", fs_name(fs_type),
+             cluster_size, sd_status.au_size_kb, sd_status.speed_class, get_write_batch_size());
+
+    // Each chunk size is run aligned, then shifted by one sector to show the read-modify-write penalty
+    for (size_t chunk : chunk_sizes) {
+        for (size_t misalign = 0; misalign <= SECTOR_SIZE; misalign += SECTOR_SIZE) {
+            FILE *fp = fopen(path, "wb");
+            if (fp == nullptr) {
+                heap_caps_free(buf);
+                return ESP_FAIL;
+            }
+
+            setvbuf(fp, nullptr, _IONBF, 0);
+            if (misalign > 0) {
+                fwrite(buf, 1, misalign, fp);
+            }
+
+            int64_t max_us = 0;
+            int64_t start_us = esp_timer_get_time();
+            for (size_t written = 0; written < BENCH_FILE_SIZE; written += chunk) {
+                int64_t write_start_us = esp_timer_get_time();
+                if (fwrite(buf, 1, chunk, fp) != chunk) {
+                    break;
+                }
+
+                int64_t write_us = esp_timer_get_time() - write_start_us;
+                max_us = write_us > max_us ? write_us : max_us;
+            }
+
+            fsync(fileno(fp));
+            int64_t total_us = esp_timer_get_time() - start_us;
+            fclose(fp);
+
+            ESP_LOGI(TAG, "chunk %6u %s: %.2f MB/s, worst write %lld ms", chunk, misalign ? "misaligned" : "aligned   ",
+                     (double)BENCH_FILE_SIZE / (double)total_us, max_us / 1000);
+        }
+    }
+
+    remove(path);
+    heap_caps_free(buf);
+    return ESP_OK;
+}
+#endif
+
 void sdmmc_manager::get_info(sdmmc_card_t *info)
 {
     if (info == nullptr) {
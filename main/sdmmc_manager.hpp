@@ -1,12 +1,43 @@
 #pragma once
 
+#include <sdkconfig.h>
 #include <esp_err.h>
 #include <esp_vfs_fat.h>
 #include <driver/sdmmc_host.h>
 #include <hal/uart_types.h>
 #include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "PsramAllocator.hpp"
 
+struct sd_status_info
+{
+    uint32_t au_size_kb; // Allocation unit, 0 if the card doesn't say
+    uint16_t erase_size_au; // AUs erased per erase timeout unit
+    uint8_t speed_class; // 0, 2, 4, 6 or 10
+    uint8_t uhs_grade;
+    uint8_t video_class;
+};
+
+enum sd_fs_type : uint8_t
+{
+    SD_FS_UNKNOWN = 0,
+    SD_FS_FAT32,
+    SD_FS_FAT16, // Also FAT12: fixed root directory, no FSINFO
+};
+
+struct sd_write_stats
+{
+    uint32_t latency_hist[24]; // Bucket n counts writes that took [2^n, 2^(n+1)) us
+    uint32_t throughput_hist[60]; // Bytes written per second, newest slot is throughput_head
+    uint32_t throughput_head;
+    uint64_t bytes_written;
+    uint32_t write_cnt;
+    uint32_t error_cnt;
+    uint32_t retry_cnt;
+    uint32_t max_latency_us;
+};
+
 class sdmmc_manager
 {
 public:
@@ -24,13 +55,61 @@ private:
 
 public:
     esp_err_t init(const char *path = "/sdcard");
+    esp_err_t remount();
+    void unmount();
+    esp_err_t check_card();
+    bool is_mounted() const { return card != nullptr; }
+    void print_info();
+    sd_fs_type get_fs_type() const { return fs_type; }
+    static const char *fs_name(sd_fs_type type);
+    uint64_t get_max_file_size() const;
     void get_info(sdmmc_card_t *info);
+    const sd_status_info &get_sd_status() const { return sd_status; }
+    size_t get_write_batch_size() const;
+    esp_err_t get_free_space(uint64_t &free_bytes);
+    void charge_write(uint64_t offset, size_t len);
+    void release_space(uint64_t old_size, uint64_t new_size = 0);
+    void record_write(size_t len, int64_t elapsed_us, bool success);
+    void record_retry();
+    void get_write_stats(sd_write_stats &stats_out);
+    static uint32_t latency_percentile(const sd_write_stats &stats, uint32_t permille);
+#ifdef CONFIG_SL_SD_BENCH_AT_BOOT
+    esp_err_t run_write_bench(const char *path = "/sdcard/bench.tmp");
+#endif
+
+private:
+    void probe_card();
+    esp_err_t read_sd_status();
+    esp_err_t check_fs_alignment();
+    esp_err_t check_data_alignment();
+    esp_err_t seed_free_space();
+    esp_err_t scan_free_clusters(uint32_t gen, uint32_t &free_cnt);
+    uint64_t cluster_bytes(uint64_t size) const;
+    void adjust_free_space(int64_t delta);
+    static void free_scan_task(void *_ctx);
 
 private:
     sdmmc_card_t *card = nullptr;
+    const char *mount_path = nullptr;
+    sd_status_info sd_status = {};
+    sd_fs_type fs_type = SD_FS_UNKNOWN;
+    uint32_t cluster_size = 0;
+    uint64_t data_start_sector = 0;
+    uint64_t fat_start_sector = 0;
+    uint32_t fsinfo_sector = 0;
+    uint32_t cluster_cnt = 0;
+    uint64_t free_bytes_cached = 0; // Kept current from writes and deletes, so queries never touch the FAT
+    bool free_space_valid = false;
+    bool free_scan_running = false;
+    int64_t free_scan_delta = 0; // Charges and releases since the running scan started
+    uint32_t mount_gen = 0; // Bumped on every unmount, so a scan notices the card went away under it
+    SemaphoreHandle_t scan_lock = nullptr; // Held by the scan around each read, and by unmount
+    sd_write_stats write_stats = {};
+    int64_t throughput_sec = 0;
+    portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
     esp_vfs_fat_sdmmc_mount_config_t mount_cfg = {
-            .format_if_mount_failed = true,
-            .max_files = 3,
+            .format_if_mount_failed = false, // Never wipe a card holding logs, it gets repaired on a host instead
+            .max_files = 8, // Segment + index per channel, plus config and spare
             .allocation_unit_size = 128*512,
             .disk_status_check_enable = true,
             .use_one_fat = false,
@@ -42,6 +121,17 @@ private:
 
 private:
     static const constexpr char TAG[] = "sdmmc_mgr";
+    static const constexpr uint32_t MOUNT_RETRY_CNT = 3;
+    static const constexpr uint32_t MOUNT_RETRY_DELAY_MS = 200;
+    static const constexpr size_t SECTOR_SIZE = 512;
+    static const constexpr uint32_t FSINFO_LEAD_SIG = 0x41615252;
+    static const constexpr uint32_t FSINFO_STRUCT_SIG = 0x61417272;
+    static const constexpr size_t DEFAULT_WRITE_BATCH = 65536;
+    static const constexpr size_t FREE_SCAN_SECTORS = 8; // FAT read per scan step
+    static const constexpr uint32_t FREE_SCAN_STEP_DELAY_MS = 10;
+    static const constexpr uint32_t FAT16_MIN_CLUSTERS = 4085; // Fewer is FAT12, whose 12-bit entries the scan doesn't decode
+    static const constexpr size_t MAX_WRITE_BATCH = 131072; // Divides every AU size up to 64MB, incl. 12MB and 24MB
+    static const constexpr size_t FORMAT_CLUSTER_SIZE = 65536; // Largest cluster FatFs makes on FAT32
     static const constexpr gpio_num_t PIN_CMD = GPIO_NUM_35;
     static const constexpr gpio_num_t PIN_CLK = GPIO_NUM_36;
     static const constexpr gpio_num_t PIN_D0 = GPIO_NUM_37;
@@ -0,0 +1,255 @@
+#include <cstddef>
+#include <cstring>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <esp_heap_caps.h>
+#include "segment_journal.hpp"
+#include "segment_writer.hpp"
+#include "sdmmc_manager.hpp"
+
+using namespace log_format;
+
+static bool read_at(FILE *fp, uint64_t offset, void *buf, size_t len)
+{
+    return fseeko(fp, (off_t)offset, SEEK_SET) == 0 && fread(buf, 1, len, fp) == len;
+}
+
+esp_err_t segment_journal::recover(const char *path)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    // Also runs after a remount, where the handle from before belongs to the old mount
+    if (fp != nullptr) {
+        fclose(fp);
+        fp = nullptr;
+    }
+
+    FILE *old_fp = fopen(path, "rb");
+    uint64_t old_size = 0;
+    if (old_fp != nullptr) {
+        fseeko(old_fp, 0, SEEK_END);
+        old_size = ftello(old_fp);
+        fseeko(old_fp, 0, SEEK_SET);
+        scratch = (uint8_t *)heap_caps_malloc(SCRATCH_SIZE, MALLOC_CAP_SPIRAM);
+        if (scratch == nullptr) {
+            fclose(old_fp);
+            return ESP_ERR_NO_MEM;
+        }
+
+        journal_entry entry = {};
+        size_t seg_cnt = 0;
+        while (fread(&entry, sizeof(entry), 1, old_fp) == 1) {
+            if (entry.magic != JOURNAL_MAGIC || entry.crc != esp_rom_crc32_le(0, (const uint8_t *)&entry, offsetof(journal_entry, crc))) {
+                ESP_LOGW(TAG, "Skipping torn journal entry");
+                continue;
+            }
+
+            entry.path[sizeof(entry.path) - 1] = '\0';
+            recover_segment(entry.path);
+            seg_cnt++;
+        }
+
+        fclose(old_fp);
+        heap_caps_free(scratch);
+        scratch = nullptr;
+        ESP_LOGI(TAG, "Checked %u segment(s) from last boot in %lld ms", seg_cnt, (esp_timer_get_time() - start_us) / 1000);
+    }
+
+    // Everything from the last boot is consistent now, start over for this one
+    fp = fopen(path, "wb");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "Can't open journal %s", path);
+        return ESP_FAIL;
+    }
+
+    sdmmc_manager::instance()->release_space(old_size);
+    size = 0;
+
+    return ESP_OK;
+}
+
+esp_err_t segment_journal::add(const char *segment_path, uint32_t boot_id)
+{
+    if (fp == nullptr || segment_path == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (strlen(segment_path) >= sizeof(journal_entry::path)) {
+        ESP_LOGE(TAG, "Segment path too long: %s", segment_path);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    journal_entry entry = {};
+    entry.magic = JOURNAL_MAGIC;
+    entry.boot_id = boot_id;
+    strncpy(entry.path, segment_path, sizeof(entry.path) - 1);
+    entry.crc = esp_rom_crc32_le(0, (const uint8_t *)&entry, offsetof(journal_entry, crc));
+
+    if (fwrite(&entry, sizeof(entry), 1, fp) != 1 || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        ESP_LOGE(TAG, "Journal write failed");
+        return ESP_FAIL;
+    }
+
+    sdmmc_manager::instance()->charge_write(size, sizeof(entry));
+    size += sizeof(entry);
+
+    return ESP_OK;
+}
+
+esp_err_t segment_journal::recover_segment(const char *path)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    FILE *seg_fp = fopen(path, "r+b");
+    if (seg_fp == nullptr) {
+        ESP_LOGW(TAG, "%s: gone, nothing to recover", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    fseeko(seg_fp, 0, SEEK_END);
+    uint64_t seg_len = ftello(seg_fp);
+
+    char idx_path[64] = {};
+    segment_writer::make_index_path(path, idx_path, sizeof(idx_path));
+    FILE *idx_fp = fopen(idx_path, "r+b");
+
+    // Resume from the newest index entry that still checks out, so only the tail gets read
+    uint64_t offset = 0;
+    uint32_t expect_seq = 0;
+    uint32_t idx_keep_cnt = 0;
+    bool seq_known = find_resume_point(seg_fp, idx_fp, seg_len, offset, expect_seq, idx_keep_cnt);
+
+    uint64_t good_end = offset;
+    uint32_t block_cnt = 0;
+    while (offset + sizeof(uint32_t) <= seg_len) {
+        uint32_t magic = 0;
+        if (!read_at(seg_fp, offset, &magic, sizeof(magic))) {
+            break;
+        }
+
+        if (magic == FILE_MAGIC) {
+            file_header hdr = {};
+            if (offset + sizeof(hdr) > seg_len || !read_at(seg_fp, offset, &hdr, sizeof(hdr)) ||
+                hdr.header_crc != esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(file_header, header_crc)) ||
+                offset + sizeof(hdr) + hdr.config_len > seg_len ||
+                !check_payload_crc(seg_fp, offset + sizeof(hdr), hdr.config_len, hdr.config_crc)) {
+                break;
+            }
+
+            offset += sizeof(hdr) + hdr.config_len;
+            seq_known = false; // A new session starts its own sequence
+        } else if (magic == BLOCK_MAGIC) {
+            block_header hdr = {};
+            if (offset + sizeof(hdr) > seg_len || !read_at(seg_fp, offset, &hdr, sizeof(hdr)) ||
+                hdr.header_crc != esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(block_header, header_crc)) ||
+                (seq_known && hdr.seq != expect_seq) ||
+                offset + sizeof(hdr) + hdr.stored_len > seg_len ||
+                !check_payload_crc(seg_fp, offset + sizeof(hdr), hdr.stored_len, hdr.payload_crc)) {
+                break;
+            }
+
+            offset += sizeof(hdr) + hdr.stored_len;
+            expect_seq = hdr.seq + 1;
+            seq_known = true;
+            block_cnt++;
+        } else {
+            break;
+        }
+
+        good_end = offset;
+    }
+
+    esp_err_t ret = ESP_OK;
+    if (good_end < seg_len) {
+        if (ftruncate(fileno(seg_fp), (off_t)good_end) != 0) {
+            ESP_LOGE(TAG, "%s: failed to truncate torn tail", path);
+            ret = ESP_FAIL;
+        } else {
+            ESP_LOGW(TAG, "%s: dropped %llu torn byte(s) after offset %llu", path, seg_len - good_end, good_end);
+            sdmmc_manager::instance()->release_space(seg_len, good_end);
+        }
+    }
+
+    // Drop index entries that are torn or now point past the end
+    if (idx_fp != nullptr) {
+        while (idx_keep_cnt > 0) {
+            index_entry entry = {};
+            if (read_at(idx_fp, (uint64_t)(idx_keep_cnt - 1) * sizeof(entry), &entry, sizeof(entry)) && entry.offset < good_end) {
+                break;
+            }
+
+            idx_keep_cnt--;
+        }
+
+        fseek(idx_fp, 0, SEEK_END);
+        uint64_t idx_len = ftell(idx_fp);
+        uint64_t idx_keep_len = (uint64_t)idx_keep_cnt * sizeof(index_entry);
+        if (idx_len != idx_keep_len && ftruncate(fileno(idx_fp), (off_t)idx_keep_len) == 0) {
+            sdmmc_manager::instance()->release_space(idx_len, idx_keep_len);
+        }
+
+        fclose(idx_fp);
+    }
+
+    fclose(seg_fp);
+    ESP_LOGI(TAG, "%s: %llu byte(s) valid, %lu tail block(s) checked in %lld ms",
+             path, good_end, block_cnt, (esp_timer_get_time() - start_us) / 1000);
+    return ret;
+}
+
+bool segment_journal::find_resume_point(FILE *seg_fp, FILE *idx_fp, uint64_t seg_len, uint64_t &offset, uint32_t &seq, uint32_t &idx_keep_cnt)
+{
+    offset = 0;
+    idx_keep_cnt = 0;
+    if (idx_fp == nullptr) {
+        return false;
+    }
+
+    fseek(idx_fp, 0, SEEK_END);
+    auto entry_cnt = (uint32_t)(ftell(idx_fp) / sizeof(index_entry));
+
+    // Walk back from the newest entry until one points at an intact block header
+    for (uint32_t idx = entry_cnt; idx > 0; idx--) {
+        index_entry entry = {};
+        if (!read_at(idx_fp, (uint64_t)(idx - 1) * sizeof(entry), &entry, sizeof(entry)) || entry.magic != INDEX_MAGIC ||
+            entry.crc != esp_rom_crc32_le(0, (const uint8_t *)&entry, offsetof(index_entry, crc))) {
+            continue;
+        }
+
+        block_header hdr = {};
+        if (entry.offset + sizeof(hdr) > seg_len || !read_at(seg_fp, entry.offset, &hdr, sizeof(hdr)) ||
+            hdr.magic != BLOCK_MAGIC || hdr.seq != entry.seq ||
+            hdr.header_crc != esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(block_header, header_crc))) {
+            continue;
+        }
+
+        offset = entry.offset;
+        seq = entry.seq;
+        idx_keep_cnt = idx;
+        return true;
+    }
+
+    return false;
+}
+
+bool segment_journal::check_payload_crc(FILE *seg_fp, uint64_t offset, uint32_t len, uint32_t expect_crc)
+{
+    if (fseeko(seg_fp, (off_t)offset, SEEK_SET) != 0) {
+        return false;
+    }
+
+    uint32_t crc = 0;
+    while (len > 0) {
+        size_t chunk = len > SCRATCH_SIZE ? SCRATCH_SIZE : len;
+        if (fread(scratch, 1, chunk, seg_fp) != chunk) {
+            return false;
+        }
+
+        crc = esp_rom_crc32_le(crc, scratch, chunk);
+        len -= chunk;
+    }
+
+    return crc == expect_crc;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdio>
+#include <esp_err.h>
+#include "log_format.hpp"
+
+// Keeps track of segments written by this boot, and repairs the ones left open by the previous one
+class segment_journal
+{
+public:
+    static segment_journal *instance()
+    {
+        static segment_journal _instance;
+        return &_instance;
+    }
+
+    segment_journal(segment_journal const &) = delete;
+    void operator=(segment_journal const &) = delete;
+
+private:
+    segment_journal() = default;
+
+public:
+    esp_err_t recover(const char *path = "/sdcard/journal.bin");
+    esp_err_t add(const char *segment_path, uint32_t boot_id);
+
+private:
+    esp_err_t recover_segment(const char *path);
+    bool find_resume_point(FILE *seg_fp, FILE *idx_fp, uint64_t seg_len, uint64_t &offset, uint32_t &seq, uint32_t &idx_keep_cnt);
+    bool check_payload_crc(FILE *seg_fp, uint64_t offset, uint32_t len, uint32_t expect_crc);
+
+private:
+    struct __attribute__((packed)) journal_entry
+    {
+        uint32_t magic;
+        uint32_t boot_id;
+        char path[52];
+        uint32_t crc;
+    };
+
+    FILE *fp = nullptr;
+    uint64_t size = 0;
+    uint8_t *scratch = nullptr;
+
+private:
+    static const constexpr uint32_t JOURNAL_MAGIC = 0x4a474c53; // "SLGJ"
+    static const constexpr size_t SCRATCH_SIZE = 4096;
+    static const constexpr char TAG[] = "seg_journal";
+};
@@ -0,0 +1,576 @@
+#include <new>
+#include <cstddef>
+#include <cstring>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+#include <esp_app_desc.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "segment_writer.hpp"
+#include "sdmmc_manager.hpp"
+
+using namespace log_format;
+
+esp_err_t segment_writer::init(const char *path, const segment_info &_info)
+{
+    if (path == nullptr || _info.write_batch == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // One fixed arena for raw block, compressed block and write batch, nothing gets allocated per block afterwards
+    if (arena == nullptr) {
+        batch_cap = _info.write_batch;
+        arena = (uint8_t *)heap_caps_malloc(BLOCK_SIZE + OUT_BUF_SIZE + batch_cap, MALLOC_CAP_SPIRAM);
+        if (arena == nullptr) {
+            ESP_LOGE(TAG, "%s: can't allocate block arena", name);
+            return ESP_ERR_NO_MEM;
+        }
+
+        raw_buf = arena;
+        out_buf = arena + BLOCK_SIZE;
+        batch_buf = out_buf + OUT_BUF_SIZE;
+    }
+
+    // Hash table is hit on every input byte, keep it in internal RAM
+    if (_info.compress && codec == nullptr) {
+        void *codec_mem = heap_caps_malloc(sizeof(lz4_codec), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (codec_mem == nullptr) {
+            ESP_LOGE(TAG, "%s: can't allocate codec", name);
+            return ESP_ERR_NO_MEM;
+        }
+
+        codec = new (codec_mem) lz4_codec();
+    }
+
+    // A batch still here never made it out, its whole blocks go into this file instead
+    keep_batch();
+    info = _info;
+    block_seq = 0;
+    force_index = true;
+    index_pending_cnt = 0;
+
+    fp = fopen(path, "ab");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "%s: failed to open %s", name, path);
+        return ESP_FAIL;
+    }
+
+    // Batches already do the buffering, let them hit FatFs whole so aligned ones go out as multi-block writes
+    setvbuf(fp, nullptr, _IONBF, 0);
+    fseeko(fp, 0, SEEK_END);
+    data_offset = ftello(fp);
+    batch_offset = data_offset;
+    batch_len = 0;
+    batch_failed = false;
+    batch_size = info.write_batch < batch_cap ? info.write_batch : batch_cap;
+
+    char idx_path[64] = {};
+    make_index_path(path, idx_path, sizeof(idx_path));
+    idx_fp = fopen(idx_path, "ab");
+    if (idx_fp == nullptr) {
+        ESP_LOGW(TAG, "%s: failed to open index %s, seeking will need a full scan", name, idx_path);
+    } else {
+        fseeko(idx_fp, 0, SEEK_END);
+        idx_size = ftello(idx_fp);
+    }
+
+    esp_err_t ret = write_file_header();
+    if (ret != ESP_OK) {
+        fclose(fp);
+        fp = nullptr;
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "%s: writing to %s, compression %s", name, path, info.compress ? "on" : "off");
+    return ESP_OK;
+}
+
+void segment_writer::make_index_path(const char *path, char *out, size_t out_len)
+{
+    // Sidecar index lives next to the segment: uart1.slg -> uart1.idx
+    if (path == nullptr || out == nullptr || out_len < 5) {
+        return;
+    }
+
+    strncpy(out, path, out_len - 5);
+    out[out_len - 5] = '\0';
+
+    char *ext = strrchr(out, '.');
+    char *slash = strrchr(out, '/');
+    if (ext == nullptr || (slash != nullptr && ext < slash)) {
+        ext = out + strlen(out);
+    }
+
+    strcpy(ext, ".idx");
+}
+
+esp_err_t segment_writer::append(const uint8_t *buf, size_t len, int64_t ts_us)
+{
+    return add_record(buf, len, ts_us, nullptr);
+}
+
+esp_err_t segment_writer::append_tagged(const uint8_t *buf, size_t len, int64_t ts_us, uint8_t tag)
+{
+    return add_record(buf, len, ts_us, &tag);
+}
+
+esp_err_t segment_writer::add_record(const uint8_t *buf, size_t len, int64_t ts_us, const uint8_t *tag)
+{
+    if (buf == nullptr || fp == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t tag_len = tag != nullptr ? 1 : 0;
+    esp_err_t ret = ESP_OK;
+    last_add_cnt = 0;
+    last_record_lost = false;
+    do {
+        size_t rec_len = len > MAX_RECORD_LEN - tag_len ? MAX_RECORD_LEN - tag_len : len;
+
+        // Start over when the record doesn't fit, or its delta can't be expressed (e.g. clock stepped back)
+        if (raw_len > 0 && (raw_len + sizeof(record_header) + tag_len + rec_len > BLOCK_SIZE ||
+                            ts_us < first_ts_us || ts_us - first_ts_us > (int64_t)UINT32_MAX)) {
+            ret = write_block();
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        }
+
+        if (raw_len == 0) {
+            first_ts_us = ts_us;
+            block_start_us = esp_timer_get_time();
+        }
+
+        record_header rec = {};
+        rec.ts_delta_us = (uint32_t)(ts_us - first_ts_us);
+        rec.len = (uint16_t)(tag_len + rec_len);
+        memcpy(raw_buf + raw_len, &rec, sizeof(rec));
+        if (tag != nullptr) {
+            raw_buf[raw_len + sizeof(rec)] = *tag;
+        }
+
+        memcpy(raw_buf + raw_len + sizeof(rec) + tag_len, buf, rec_len);
+        raw_len += sizeof(rec) + tag_len + rec_len;
+
+        last_ts_us = ts_us;
+        record_count++;
+        last_add_cnt++;
+        buf += rec_len;
+        len -= rec_len;
+    } while (len > 0);
+
+    return ret;
+}
+
+esp_err_t segment_writer::flush()
+{
+    if (fp == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = write_block();
+    ret = ret ?: flush_batch();
+
+    // fsync() commits the FAT size field, so a power cut loses at most the last sync interval
+    int64_t start_us = esp_timer_get_time();
+    bool synced = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    sdmmc_manager::instance()->record_write(0, esp_timer_get_time() - start_us, synced);
+    if (!synced) {
+        ESP_LOGE(TAG, "%s: flush failed", name);
+        return ESP_FAIL;
+    }
+
+    last_sync_us = esp_timer_get_time();
+    synced_offset = data_offset;
+
+    // Index goes out only after the data it points to
+    esp_err_t idx_ret = write_index();
+    return ret ?: idx_ret;
+}
+
+esp_err_t segment_writer::close()
+{
+    if (fp == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = flush();
+    fclose(fp);
+    fp = nullptr;
+
+    if (idx_fp != nullptr) {
+        fclose(idx_fp);
+        idx_fp = nullptr;
+    }
+
+    return ret;
+}
+
+void segment_writer::abandon()
+{
+    // Card is gone: drop the file handles without flushing, the journal repairs the tail on remount.
+    // The block being assembled stays, and so do the blocks waiting in the batch; both go into the next segment.
+    if (fp != nullptr) {
+        fclose(fp);
+        fp = nullptr;
+    }
+
+    if (idx_fp != nullptr) {
+        fclose(idx_fp);
+        idx_fp = nullptr;
+    }
+
+    keep_batch();
+    index_pending_cnt = 0;
+}
+
+bool segment_writer::resend_last_record()
+{
+    // For a caller that still holds the newest record: if it went down with the batch, it's appended again
+    // rather than counted lost
+    if (!last_record_lost) {
+        return false;
+    }
+
+    lost_record_cnt -= last_add_cnt;
+    last_record_lost = false;
+    return true;
+}
+
+esp_err_t segment_writer::write_gap(int64_t offline_us, int64_t online_us, uint32_t dropped_lines)
+{
+    if (fp == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Whatever was captured before the outage goes in first
+    esp_err_t ret = write_block();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    gap_record gap = {};
+    gap.offline_us = offline_us;
+    gap.online_us = online_us;
+    gap.dropped_lines = dropped_lines + lost_record_cnt;
+
+    block_header hdr = {};
+    hdr.magic = BLOCK_MAGIC;
+    hdr.channel = info.channel;
+    hdr.codec = CODEC_NONE;
+    hdr.flags = BLOCK_FLAG_GAP;
+    hdr.seq = block_seq++;
+    hdr.first_ts_us = offline_us;
+    hdr.last_ts_us = online_us;
+    hdr.raw_len = sizeof(gap);
+    hdr.stored_len = sizeof(gap);
+    hdr.payload_crc = esp_rom_crc32_le(0, (const uint8_t *)&gap, sizeof(gap));
+    hdr.header_crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(block_header, header_crc));
+
+    ret = emit(&hdr, sizeof(hdr));
+    ret = ret ?: emit(&gap, sizeof(gap));
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "%s: gap marker write failed", name);
+        return ret;
+    }
+
+    data_offset += sizeof(hdr) + sizeof(gap);
+    note_block(sizeof(hdr) + sizeof(gap), 0);
+    lost_record_cnt = 0;
+    return ESP_OK;
+}
+
+bool segment_writer::should_flush(int64_t now_us) const
+{
+    if (raw_len > 0 && (now_us - block_start_us) >= BLOCK_MAX_AGE_US) {
+        return true;
+    }
+
+    return data_offset != synced_offset && (now_us - last_sync_us) >= SYNC_INTERVAL_US;
+}
+
+esp_err_t segment_writer::write_file_header()
+{
+    struct timeval now = {};
+    gettimeofday(&now, nullptr);
+
+    file_header hdr = {};
+    hdr.magic = FILE_MAGIC;
+    hdr.version = VERSION;
+    hdr.channel = info.channel;
+    hdr.boot_id = info.boot_id;
+    hdr.created_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    strncpy(hdr.fw_version, esp_app_get_description()->version, sizeof(hdr.fw_version) - 1);
+    hdr.config_len = info.config != nullptr ? info.config_len : 0;
+    hdr.config_crc = esp_rom_crc32_le(0, (const uint8_t *)info.config, hdr.config_len);
+    hdr.header_crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(file_header, header_crc));
+
+    esp_err_t ret = emit(&hdr, sizeof(hdr));
+    ret = ret ?: emit(info.config, hdr.config_len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "%s: file header write failed", name);
+        return ret;
+    }
+
+    data_offset += sizeof(hdr) + hdr.config_len;
+    return ESP_OK;
+}
+
+esp_err_t segment_writer::write_block()
+{
+    // Blocks kept from before an outage are older than anything assembled since
+    esp_err_t ret = replay_kept();
+    if (ret != ESP_OK || raw_len == 0) {
+        return ret;
+    }
+
+    block_header hdr = {};
+    hdr.magic = BLOCK_MAGIC;
+    hdr.channel = info.channel;
+    hdr.codec = CODEC_NONE;
+    hdr.flags = info.tagged ? BLOCK_FLAG_TAGGED : 0;
+    hdr.seq = block_seq++;
+    hdr.first_ts_us = first_ts_us;
+    hdr.last_ts_us = last_ts_us;
+    hdr.record_count = record_count;
+    hdr.raw_len = raw_len;
+    hdr.stored_len = raw_len;
+
+    const uint8_t *payload = raw_buf;
+    if (info.compress && codec != nullptr) {
+        size_t comp_len = codec->compress(raw_buf, raw_len, out_buf, OUT_BUF_SIZE);
+        if (comp_len > 0 && comp_len < raw_len) {
+            hdr.codec = CODEC_LZ4;
+            hdr.stored_len = comp_len;
+            payload = out_buf;
+        }
+    }
+
+    hdr.payload_crc = esp_rom_crc32_le(0, payload, hdr.stored_len);
+    hdr.header_crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(block_header, header_crc));
+
+    raw_len = 0;
+    record_count = 0;
+    // Index entry first: it records data_offset, which emit() doesn't touch
+    add_index_entry(hdr);
+
+    ret = emit(&hdr, sizeof(hdr));
+    ret = ret ?: emit(payload, hdr.stored_len);
+    if (ret != ESP_OK) {
+        // raw_buf is untouched, keep the block so it can be written again after a remount
+        raw_len = hdr.raw_len;
+        record_count = hdr.record_count;
+        last_record_lost = false;
+        ESP_LOGE(TAG, "%s: block write failed", name);
+        return ret;
+    }
+
+    data_offset += sizeof(hdr) + hdr.stored_len;
+    note_block(sizeof(hdr) + hdr.stored_len, hdr.record_count);
+    return ESP_OK;
+}
+
+void segment_writer::note_block(size_t block_len, uint32_t block_record_cnt)
+{
+    // Called after a block went into the batch. It lies there whole unless a flush cut it in two on the way in
+    if (batch_len == 0) {
+        return;
+    }
+
+    batch_record_cnt += block_record_cnt;
+    newest_whole = batch_len >= block_len;
+    if (newest_whole) {
+        whole_start = whole_end > 0 ? whole_start : batch_len - block_len;
+        whole_end = batch_len;
+        whole_record_cnt += block_record_cnt;
+    }
+}
+
+esp_err_t segment_writer::replay_kept()
+{
+    // All or nothing: if this file fails too, the copies made so far were never synced and the kept
+    // blocks wait for the one after it
+    for (size_t pos = 0; pos < kept_len;) {
+        block_header hdr = {};
+        memcpy(&hdr, kept_buf + pos, sizeof(hdr));
+        size_t block_len = sizeof(hdr) + hdr.stored_len;
+        hdr.seq = block_seq++; // Renumbered, the journal expects one sequence per file
+        hdr.header_crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, offsetof(block_header, header_crc));
+        add_index_entry(hdr);
+
+        esp_err_t ret = emit(&hdr, sizeof(hdr));
+        ret = ret ?: emit(kept_buf + pos + sizeof(hdr), hdr.stored_len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "%s: writing kept blocks failed", name);
+            return ret;
+        }
+
+        pos += block_len;
+        data_offset += block_len;
+        note_block(block_len, hdr.record_count);
+    }
+
+    if (kept_buf != nullptr) {
+        ESP_LOGI(TAG, "%s: %u byte(s) kept through the outage written, %lu record(s)", name, kept_len, kept_record_cnt);
+    }
+
+    free_kept();
+    return ESP_OK;
+}
+
+void segment_writer::free_kept()
+{
+    heap_caps_free(kept_buf);
+    kept_buf = nullptr;
+    kept_len = 0;
+    kept_record_cnt = 0;
+}
+
+esp_err_t segment_writer::emit(const void *buf, size_t len)
+{
+    auto *src = (const uint8_t *)buf;
+    while (len > 0) {
+        // Fill up to the next batch boundary within the file; after a partial flush this re-aligns
+        size_t limit = batch_size - (size_t)(batch_offset % batch_size);
+        size_t copy_len = (len > limit - batch_len) ? (limit - batch_len) : len;
+        memcpy(batch_buf + batch_len, src, copy_len);
+        batch_len += copy_len;
+        src += copy_len;
+        len -= copy_len;
+
+        if (batch_len == limit) {
+            esp_err_t ret = flush_batch();
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t segment_writer::flush_batch()
+{
+    if (batch_len == 0) {
+        return ESP_OK;
+    }
+
+    if (batch_failed) {
+        return ESP_FAIL;
+    }
+
+    auto *sdmmc = sdmmc_manager::instance();
+    size_t len = batch_len;
+    size_t written = 0;
+    uint64_t offset = batch_offset;
+
+    // A short write leaves the file position after what did land, so carry on with the rest
+    for (uint32_t attempt = 0; attempt <= WRITE_RETRY_CNT && written < len; attempt++) {
+        if (attempt > 0) {
+            sdmmc->record_retry();
+        }
+
+        int64_t start_us = esp_timer_get_time();
+        size_t ret = fwrite(batch_buf + written, 1, len - written, fp);
+        sdmmc->record_write(ret, esp_timer_get_time() - start_us, ret == len - written);
+        sdmmc->charge_write(offset + written, ret);
+        written += ret;
+    }
+
+    // Nothing more goes into this file, the batch stays in RAM for keep_batch(). What did land isn't synced,
+    // so the file size on the card still ends before it
+    if (written != len) {
+        ESP_LOGE(TAG, "%s: batch write failed, %u of %u bytes", name, written, len);
+        batch_failed = true;
+        return ESP_FAIL;
+    }
+
+    batch_offset += len;
+    batch_len = 0;
+    batch_record_cnt = 0;
+    whole_start = 0;
+    whole_end = 0;
+    whole_record_cnt = 0;
+    return ESP_OK;
+}
+
+void segment_writer::keep_batch()
+{
+    // Whole blocks are copied aside until the next file takes them, batch_buf is needed for its header.
+    // A block cut by an earlier flush is lost, its head is in the old file already. With blocks still kept
+    // from before, the batch only holds copies of them, since nothing else gets written until they're out
+    uint32_t cut_cnt = kept_buf != nullptr ? 0 : batch_record_cnt - whole_record_cnt;
+    size_t whole_len = kept_buf != nullptr ? 0 : whole_end - whole_start;
+    kept_buf = whole_len > 0 ? (uint8_t *)heap_caps_malloc(whole_len, MALLOC_CAP_SPIRAM) : kept_buf;
+    if (whole_len > 0 && kept_buf != nullptr) {
+        memcpy(kept_buf, batch_buf + whole_start, whole_len);
+        kept_len = whole_len;
+        kept_record_cnt = whole_record_cnt;
+    } else if (whole_len > 0) {
+        ESP_LOGE(TAG, "%s: can't keep %u byte(s) of blocks", name, whole_len);
+        cut_cnt = batch_record_cnt;
+        newest_whole = false;
+    }
+
+    if (cut_cnt > 0 && !newest_whole && raw_len == 0) {
+        last_record_lost = true; // Nothing appended since, so the newest record is in the lost part
+    }
+
+    lost_record_cnt += cut_cnt;
+
+    batch_len = 0;
+    batch_record_cnt = 0;
+    whole_start = 0;
+    whole_end = 0;
+    whole_record_cnt = 0;
+}
+
+void segment_writer::add_index_entry(const block_header &hdr)
+{
+    if (idx_fp == nullptr) {
+        return;
+    }
+
+    if (!force_index && data_offset - last_index_offset < INDEX_INTERVAL_BYTES &&
+        hdr.first_ts_us >= last_index_ts_us && hdr.first_ts_us - last_index_ts_us < INDEX_INTERVAL_US) {
+        return;
+    }
+
+    if (index_pending_cnt >= sizeof(index_pending) / sizeof(index_pending[0])) {
+        flush_batch();
+        write_index();
+    }
+
+    index_entry &entry = index_pending[index_pending_cnt++];
+    entry = {};
+    entry.magic = INDEX_MAGIC;
+    entry.seq = hdr.seq;
+    entry.ts_us = hdr.first_ts_us;
+    entry.offset = data_offset;
+    entry.crc = esp_rom_crc32_le(0, (const uint8_t *)&entry, offsetof(index_entry, crc));
+
+    force_index = false;
+    last_index_offset = data_offset;
+    last_index_ts_us = hdr.first_ts_us;
+}
+
+esp_err_t segment_writer::write_index()
+{
+    if (idx_fp == nullptr || index_pending_cnt == 0) {
+        return ESP_OK;
+    }
+
+    size_t pending_cnt = index_pending_cnt;
+    index_pending_cnt = 0;
+    size_t written = fwrite(index_pending, sizeof(index_entry), pending_cnt, idx_fp);
+    sdmmc_manager::instance()->charge_write(idx_size, written * sizeof(index_entry));
+    idx_size += written * sizeof(index_entry);
+    if (written != pending_cnt || fflush(idx_fp) != 0 || fsync(fileno(idx_fp)) != 0) {
+        ESP_LOGW(TAG, "%s: index write failed", name);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdio>
+#include <esp_err.h>
+#include "lz4_codec.hpp"
+#include "log_format.hpp"
+
+struct segment_info
+{
+    uint8_t channel;
+    uint32_t boot_id;
+    bool compress;
+    const char *config; // Snapshot stored in the file header, may be nullptr
+    size_t config_len;
+    size_t write_batch; // Writes are combined into chunks of this size, aligned to it within the file
+    bool tagged; // Records carry their source channel, for the merged segment
+};
+
+class segment_writer
+{
+public:
+    explicit segment_writer(const char *_name = "seg") : name(_name) {}
+    esp_err_t init(const char *path, const segment_info &_info);
+    esp_err_t append(const uint8_t *buf, size_t len, int64_t ts_us);
+    esp_err_t append_tagged(const uint8_t *buf, size_t len, int64_t ts_us, uint8_t tag);
+    esp_err_t flush();
+    esp_err_t close();
+    void abandon();
+    bool resend_last_record();
+    esp_err_t write_gap(int64_t offline_us, int64_t online_us, uint32_t dropped_lines);
+    bool should_flush(int64_t now_us) const;
+    uint64_t get_size() const { return data_offset; }
+    static void make_index_path(const char *path, char *out, size_t out_len);
+
+private:
+    esp_err_t add_record(const uint8_t *buf, size_t len, int64_t ts_us, const uint8_t *tag);
+    esp_err_t write_file_header();
+    esp_err_t write_block();
+    esp_err_t emit(const void *buf, size_t len);
+    esp_err_t flush_batch();
+    void note_block(size_t block_len, uint32_t block_record_cnt);
+    void keep_batch();
+    esp_err_t replay_kept();
+    void free_kept();
+    void add_index_entry(const log_format::block_header &hdr);
+    esp_err_t write_index();
+
+private:
+    const char *name;
+    FILE *fp = nullptr;
+    FILE *idx_fp = nullptr;
+    uint64_t idx_size = 0;
+    segment_info info = {};
+    lz4_codec *codec = nullptr;
+    uint8_t *arena = nullptr;
+    uint8_t *raw_buf = nullptr;
+    uint8_t *out_buf = nullptr;
+    uint8_t *batch_buf = nullptr;
+    size_t raw_len = 0;
+    size_t batch_len = 0;
+    size_t batch_cap = 0;
+    size_t batch_size = 0;
+    uint64_t batch_offset = 0;
+    bool batch_failed = false; // A flush failed, the file takes no more writes
+    uint32_t batch_record_cnt = 0; // Records of blocks that still end in batch_buf
+    size_t whole_start = 0; // Blocks that lie entirely in batch_buf, the ones that survive an abandon()
+    size_t whole_end = 0;
+    uint32_t whole_record_cnt = 0;
+    bool newest_whole = false;
+    uint8_t *kept_buf = nullptr; // Blocks from before an outage, only allocated while there are some
+    size_t kept_len = 0;
+    uint32_t kept_record_cnt = 0;
+    uint32_t lost_record_cnt = 0; // Released by the caller but never made it to the card
+    uint32_t last_add_cnt = 0; // Records the newest append was split into
+    bool last_record_lost = false;
+    uint32_t block_seq = 0;
+    uint32_t record_count = 0;
+    int64_t first_ts_us = 0;
+    int64_t last_ts_us = 0;
+    int64_t block_start_us = 0;
+    uint64_t data_offset = 0;
+    uint64_t synced_offset = 0;
+    int64_t last_sync_us = 0;
+    uint64_t last_index_offset = 0;
+    int64_t last_index_ts_us = 0;
+    bool force_index = true;
+    size_t index_pending_cnt = 0;
+    log_format::index_entry index_pending[16] = {};
+
+private:
+    static const constexpr size_t BLOCK_SIZE = 32768;
+    static const constexpr size_t MAX_RECORD_LEN = BLOCK_SIZE - sizeof(log_format::record_header);
+    static const constexpr size_t OUT_BUF_SIZE = lz4_codec::compress_bound(BLOCK_SIZE);
+    static const constexpr int64_t BLOCK_MAX_AGE_US = 1000000;
+    static const constexpr int64_t SYNC_INTERVAL_US = 1000000;
+    static const constexpr uint32_t WRITE_RETRY_CNT = 2;
+    static const constexpr uint64_t INDEX_INTERVAL_BYTES = 65536;
+    static const constexpr int64_t INDEX_INTERVAL_US = 1000000;
+    static const constexpr char TAG[] = "seg_writer";
+};
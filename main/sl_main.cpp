@@ -1,7 +1,9 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "log_writer.hpp"
 
 extern "C" void app_main(void)
 {
+    log_writer::instance()->init();
     vTaskDelay(portMAX_DELAY);
 }
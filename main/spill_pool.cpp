@@ -0,0 +1,70 @@
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "spill_pool.hpp"
+
+void *spill_pool::alloc_block()
+{
+    portENTER_CRITICAL(&lock);
+    free_node *node = free_list;
+    if (node != nullptr) {
+        free_list = node->next;
+        free_cnt--;
+    } else if (allocated_cnt < MAX_BLOCKS) {
+        allocated_cnt++; // Reserve the slot, the heap can't be touched in here
+    } else {
+        stats.alloc_failures++;
+        portEXIT_CRITICAL(&lock);
+        return nullptr;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    void *block = node;
+    if (block == nullptr) {
+        block = heap_caps_malloc(BLOCK_SIZE, MALLOC_CAP_SPIRAM);
+    }
+
+    portENTER_CRITICAL(&lock);
+    if (block == nullptr) {
+        allocated_cnt--;
+        stats.alloc_failures++;
+    } else {
+        stats.blocks_in_use++;
+        if (stats.blocks_in_use > stats.peak_blocks) {
+            stats.peak_blocks = stats.blocks_in_use;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+
+    return block;
+}
+
+void spill_pool::free_block(void *block)
+{
+    if (block == nullptr) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    stats.blocks_in_use--;
+    bool keep = free_cnt < SPARE_BLOCKS;
+    if (keep) {
+        auto *node = (free_node *)block;
+        node->next = free_list;
+        free_list = node;
+        free_cnt++;
+    } else {
+        allocated_cnt--;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (!keep) {
+        heap_caps_free(block);
+    }
+}
+
+void spill_pool::get_stats(spill_pool_stats &stats_out)
+{
+    portENTER_CRITICAL(&lock);
+    stats_out = stats;
+    portEXIT_CRITICAL(&lock);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <sdkconfig.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+
+struct spill_pool_stats
+{
+    uint32_t blocks_in_use;
+    uint32_t peak_blocks;
+    uint32_t max_blocks;
+    uint32_t alloc_failures;
+};
+
+// PSRAM overflow blocks shared by all UART rings, allocated on demand and trimmed back once idle
+class spill_pool
+{
+public:
+    static spill_pool *instance()
+    {
+        static spill_pool _instance;
+        return &_instance;
+    }
+
+    spill_pool(spill_pool const &) = delete;
+    void operator=(spill_pool const &) = delete;
+
+private:
+    spill_pool() = default;
+
+public:
+    void *alloc_block();
+    void free_block(void *block);
+    void get_stats(spill_pool_stats &stats_out);
+
+public:
+    static const constexpr size_t BLOCK_SIZE = 65536;
+
+private:
+    struct free_node
+    {
+        free_node *next;
+    };
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    free_node *free_list = nullptr;
+    uint32_t free_cnt = 0;
+    uint32_t allocated_cnt = 0;
+    spill_pool_stats stats = { 0, 0, MAX_BLOCKS, 0 };
+
+private:
+    static const constexpr uint32_t MAX_BLOCKS = (CONFIG_SL_SPILL_POOL_KB * 1024) / BLOCK_SIZE;
+    static const constexpr uint32_t SPARE_BLOCKS = 2; // Kept around so a stall doesn't start with a burst of mallocs
+    static const constexpr char TAG[] = "spill_pool";
+};
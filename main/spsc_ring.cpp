@@ -0,0 +1,72 @@
+#include "spsc_ring.hpp"
+
+esp_err_t spsc_ring::init(uint8_t *_storage, size_t _size)
+{
+    // Power of two so the free running positions can be masked, and they can't get ambiguous below 2GB
+    if (_storage == nullptr || _size < HDR_SIZE * 2 || (_size & (_size - 1)) != 0 || _size > 0x80000000UL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    storage = _storage;
+    size = _size;
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    wr_pos = 0;
+    rd_pos = 0;
+    return ESP_OK;
+}
+
+uint8_t *spsc_ring::reserve(size_t len)
+{
+    size_t need = record_size(len);
+    uint32_t off = wr_pos & (size - 1);
+    uint32_t skip = off + need > size ? size - off : 0;
+    if (need > size || wr_pos + skip + need - tail.load(std::memory_order_acquire) > size) {
+        return nullptr;
+    }
+
+    if (skip > 0) {
+        *(uint32_t *)(storage + off) = WRAP_MARK;
+        wr_pos += skip;
+        off = 0;
+    }
+
+    *(uint32_t *)(storage + off) = len;
+    wr_pos += need;
+    return storage + off + HDR_SIZE;
+}
+
+void spsc_ring::commit()
+{
+    head.store(wr_pos, std::memory_order_release);
+}
+
+void spsc_ring::abort()
+{
+    wr_pos = head.load(std::memory_order_relaxed);
+}
+
+uint8_t *spsc_ring::peek(size_t *len_out)
+{
+    if (rd_pos == head.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+
+    // A wrap mark is committed together with the record behind it
+    uint32_t off = rd_pos & (size - 1);
+    uint32_t len = *(uint32_t *)(storage + off);
+    if (len == WRAP_MARK) {
+        rd_pos += size - off;
+        off = 0;
+        len = *(uint32_t *)storage;
+    }
+
+    rd_pos += record_size(len);
+    *len_out = len;
+    return storage + off + HDR_SIZE;
+}
+
+void spsc_ring::release()
+{
+    tail.store(rd_pos, std::memory_order_release);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+
+// Variable-length records between exactly one producer task and one consumer task, without locks:
+// the producer only ever moves head and the consumer only ever moves tail.
+// A record is a 4-byte length and the payload, padded to 4. Records never wrap, the producer
+// skips the end of the storage instead. Reserves and peeks batch up, commit() and release()
+// publish all of them at once.
+class spsc_ring
+{
+public:
+    esp_err_t init(uint8_t *_storage, size_t _size);
+
+    // Producer side
+    uint8_t *reserve(size_t len);
+    void commit();
+    void abort(); // Drops everything reserved since the last commit()
+
+    // Consumer side
+    uint8_t *peek(size_t *len_out);
+    void release();
+    size_t get_unreleased() const { return rd_pos - tail.load(std::memory_order_relaxed); }
+
+    size_t get_size() const { return size; }
+    size_t get_used() const { return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed); }
+    static constexpr size_t record_size(size_t len) { return (HDR_SIZE + len + 3) & ~(size_t)3; }
+
+public:
+    static const constexpr size_t HDR_SIZE = sizeof(uint32_t);
+
+private:
+    uint8_t *storage = nullptr;
+    uint32_t size = 0;
+    std::atomic<uint32_t> head = 0; // Free running, storage offset is pos & (size - 1)
+    std::atomic<uint32_t> tail = 0;
+    uint32_t wr_pos = 0; // Producer only, runs ahead of head by what's reserved but not committed
+    uint32_t rd_pos = 0; // Consumer only, runs ahead of tail by what's peeked but not released
+
+private:
+    static const constexpr uint32_t WRAP_MARK = UINT32_MAX;
+};
@@ -1,26 +1,39 @@
+#include <cstddef>
+#include <cstring>
 #include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_cpu.h>
+#include <freertos/ringbuf.h>
 #include "uart_manager.hpp"
 #include "config_loader.hpp"
+#include "spill_pool.hpp"
 
 esp_err_t uart_manager::init()
 {
     auto *cfg = config_loader::instance();
     esp_err_t ret = cfg->get_uart_cfg(uart_port, pin_tx, pin_rx, pin_rts, pin_cts, &uart_cfg);
-    if (ret != ESP_OK && uart_is_driver_installed(uart_port) && uart_port != UART_NUM_0) {
-        ret = uart_driver_delete(uart_port);
+    if (ret != ESP_OK) {
+        if (uart_is_driver_installed(uart_port) && uart_port != UART_NUM_0) {
+            uart_driver_delete(uart_port);
+        }
+
         ESP_LOGW(TAG, "UART%d not configured", uart_port);
         return ret;
+    }
+
+    ret = uart_driver_install(uart_port, RX_BUF_SIZE, TX_BUF_SIZE, PATTERN_QUEUE_LEN, &uart_queue, 0);
+    ret = ret ?: uart_param_config(uart_port, &uart_cfg);
+    ret = ret ?: uart_set_pin(uart_port, pin_tx, pin_rx, pin_rts, pin_cts);
+    if (capture_runs) {
+        ret = ret ?: uart_set_rx_full_threshold(uart_port, RUN_FIFO_THRESHOLD);
+        ret = ret ?: uart_set_rx_timeout(uart_port, idle_symbols);
     } else {
-        ret = uart_driver_install(uart_port, RX_BUF_SIZE, TX_BUF_SIZE, 20, &uart_queue, 0);
-        ret = ret ?: uart_param_config(uart_port, &uart_cfg);
-        ret = ret ?: uart_set_pin(uart_port, pin_tx, pin_rx, pin_rts, pin_cts);
         ret = ret ?: uart_enable_pattern_det_baud_intr(uart_port, '\n', 1, 9, 0, 0);
-        ret = ret ?: uart_pattern_queue_reset(uart_port, 20);
-        ESP_LOGI(TAG, "UART%d configured ret=0x%x, Tx=%d, Rx=%d, RTS=%d, CTS=%d", uart_port, ret, pin_tx, pin_rx, pin_rts, pin_cts);
+        ret = ret ?: uart_pattern_queue_reset(uart_port, PATTERN_QUEUE_LEN);
     }
+    ESP_LOGI(TAG, "UART%d configured ret=0x%x, Tx=%d, Rx=%d, RTS=%d, CTS=%d", uart_port, ret, pin_tx, pin_rx, pin_rts, pin_cts);
 
-    rx_ringbuf = xRingbufferCreateWithCaps(RX_RINGBUF_SIZE, RINGBUF_TYPE_NOSPLIT, MALLOC_CAP_SPIRAM);
-    if (rx_ringbuf == nullptr) {
+    if (alloc_buffers() != ESP_OK) {
         ESP_LOGE(TAG, "Rx ringbuffer alloc failed");
         if (uart_is_driver_installed(uart_port)) {
             uart_driver_delete(uart_port);
@@ -29,10 +42,109 @@ esp_err_t uart_manager::init()
     }
 
     ESP_LOGI(TAG, "Creating event task: %s", task_name);
-    xTaskCreateWithCaps(uart_event_task, task_name, 32768, this, tskIDLE_PRIORITY + 3, &evt_task_handle, MALLOC_CAP_SPIRAM);
+    xTaskCreatePinnedToCoreWithCaps(uart_event_task, task_name, 32768, this, tskIDLE_PRIORITY + 3, &evt_task_handle, INGEST_CORE, MALLOC_CAP_SPIRAM);
     return ret;
 }
 
+esp_err_t uart_manager::alloc_buffers()
+{
+    // A port brought back up by a config reload keeps its buffers
+    if (ring_storage != nullptr) {
+        return ESP_OK;
+    }
+
+    stage = (uint8_t *)heap_caps_aligned_alloc(alignof(line_batch), RX_STAGE_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ring_storage = (uint8_t *)heap_caps_aligned_alloc(CACHE_LINE_SIZE, RX_RINGBUF_SIZE, MALLOC_CAP_SPIRAM);
+    if (stage == nullptr || ring_storage == nullptr || rx_ring.init(ring_storage, RX_RINGBUF_SIZE) != ESP_OK) {
+        free_buffers();
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void uart_manager::free_buffers()
+{
+    heap_caps_free(ring_storage);
+    heap_caps_free(stage);
+    ring_storage = nullptr;
+    stage = nullptr;
+}
+
+esp_err_t uart_manager::apply_config(uint32_t changes)
+{
+    // Reconfigures the running driver, capture carries on; bytes on the wire during the switch may come out garbled
+    gpio_num_t tx = GPIO_NUM_NC;
+    gpio_num_t rx = GPIO_NUM_NC;
+    gpio_num_t rts = GPIO_NUM_NC;
+    gpio_num_t cts = GPIO_NUM_NC;
+    uart_config_t new_cfg = {};
+    esp_err_t ret = config_loader::instance()->get_uart_cfg(uart_port, tx, rx, rts, cts, &new_cfg);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (changes & PORT_CHANGE_FRAMING) {
+        ret = uart_param_config(uart_port, &new_cfg);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "UART%d: can't apply new framing 0x%x, keeping the old one", uart_port, ret);
+            return ret;
+        }
+
+        uart_cfg = new_cfg;
+        ESP_LOGI(TAG, "UART%d now at %d baud", uart_port, uart_cfg.baud_rate);
+    }
+
+    if (changes & PORT_CHANGE_PINS) {
+        ret = uart_set_pin(uart_port, tx, rx, rts, cts);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "UART%d: can't move pins 0x%x", uart_port, ret);
+            return ret;
+        }
+
+        // Pins the UART let go of would otherwise stay routed to it
+        const gpio_num_t old_pins[] = { pin_tx, pin_rx, pin_rts, pin_cts };
+        for (auto pin : old_pins) {
+            if (pin != GPIO_NUM_NC && pin != tx && pin != rx && pin != rts && pin != cts) {
+                gpio_reset_pin(pin);
+            }
+        }
+
+        pin_tx = tx;
+        pin_rx = rx;
+        pin_rts = rts;
+        pin_cts = cts;
+        ESP_LOGI(TAG, "UART%d pins now Tx=%d, Rx=%d, RTS=%d, CTS=%d", uart_port, pin_tx, pin_rx, pin_rts, pin_cts);
+    }
+
+    return ESP_OK;
+}
+
+void uart_manager::stop()
+{
+    // The event task finishes the events already queued, so lines the driver holds still reach the ring
+    if (evt_task_handle != nullptr && uart_queue != nullptr) {
+        uart_event_t evt = {};
+        evt.type = UART_EVENT_MAX;
+        xQueueSend(uart_queue, &evt, portMAX_DELAY);
+        for (uint32_t wait = 0; evt_task_handle != nullptr && wait < STOP_WAIT_MS; wait += 10) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+
+    if (evt_task_handle != nullptr) {
+        ESP_LOGE(TAG, "UART%d: event task didn't stop, leaving the driver installed", uart_port);
+        return;
+    }
+
+    if (uart_is_driver_installed(uart_port)) {
+        uart_driver_delete(uart_port);
+    }
+
+    uart_queue = nullptr;
+    ESP_LOGI(TAG, "UART%d stopped", uart_port);
+}
+
 void uart_manager::uart_event_task(void *_ctx)
 {
     uart_event_t evt = {};
@@ -49,6 +161,12 @@ void uart_manager::uart_event_task(void *_ctx)
         }
 
         switch (evt.type) {
+            case UART_DATA:
+                if (ctx->capture_runs) {
+                    ctx->capture_run(evt.size, evt.timeout_flag);
+                }
+                break;
+
             case UART_BREAK:
                 ESP_LOGI(TAG, "uart rx break");
                 break;
@@ -68,78 +186,673 @@ void uart_manager::uart_event_task(void *_ctx)
                 break;
             }
             case UART_PATTERN_DET: {
-                size_t buf_size = 0;
-                uart_get_buffered_data_len(ctx->uart_port, &buf_size);
-                int pos = uart_pattern_pop_pos(ctx->uart_port);
-                if (pos < 0) {
-                    // There used to be a UART_PATTERN_DET event, but the pattern position queue is full so that it can not
-                    // record the position. We should set a larger queue size.
-                    // As an example, we directly flush the rx buffer here.
-                    uart_flush_input(ctx->uart_port);
-                } else if (pos != 0) {
-                    uint8_t *buf = nullptr;
-                    size_t buf_offset = 0;
-                    if (ctx->enable_timestamp) {
-                        char ts_str[128] = { 0 };
-                        struct timeval val = {};
-                        gettimeofday(&val, nullptr);
-                        snprintf(ts_str, sizeof(ts_str), "[%lld%06ld] ", val.tv_sec, val.tv_usec);
-                        ts_str[sizeof(ts_str) - 1] = '\0';
-                        buf_offset = strnlen(ts_str, sizeof(ts_str));
-                    }
-
-                    auto rb_ret = xRingbufferSendAcquire(ctx->rx_ringbuf, (void **)&buf, pos + buf_offset, pdMS_TO_TICKS(300));
-                    if (rb_ret != pdTRUE || buf == nullptr) {
-                        ESP_LOGW(TAG, "UART%d failed to allocate ringbuffer, giving up len=%d", ctx->uart_port, pos);
-                        uart_flush_input(ctx->uart_port);
-                        break;
-                    }
-
-                    int read_ret = uart_read_bytes(ctx->uart_port, buf + buf_offset, pos, pdMS_TO_TICKS(300));
-                    if (read_ret < 0) {
-                        ESP_LOGW(TAG, "UART%d failed to read: %d", ctx->uart_port, read_ret);
-                        uart_flush_input(ctx->uart_port); // Try to reset...
-                    }
-
-                    xRingbufferSendComplete(ctx->rx_ringbuf, buf);
-                } else {
-                    ESP_LOGE(TAG, "UART%d pattern detection error (nothing for Rx?)", ctx->uart_port);
-                }
-
+                ctx->capture_lines();
                 break;
             }
             case UART_WAKEUP: {
                 ESP_LOGI(TAG, "Waking up from UART %u", ctx->uart_port);
                 break;
             }
+            case UART_EVENT_MAX: {
+                // Posted by stop()
+                ctx->flush_stage();
+                ctx->evt_task_handle = nullptr;
+                vTaskDeleteWithCaps(nullptr);
+                return;
+            }
             default: {
                 break;
             }
         }
+
+        // End of a burst: whatever collected in the stage goes to the ring in one piece
+        if (uxQueueMessagesWaiting(ctx->uart_queue) == 0) {
+            ctx->flush_stage();
+        }
     }
 }
 
 esp_err_t uart_manager::wait_for_newline(uint8_t **buf, size_t *len_out, uint32_t wait_ticks)
+{
+    return wait_for_newline(buf, len_out, nullptr, wait_ticks);
+}
+
+const line_batch *uart_manager::wait_for_batch(uint32_t wait_ticks)
+{
+    // Ring records are chunks of batches, handed out one at a time: the same batch comes back until it's finished
+    if (rx_chunk == nullptr) {
+        // Ring records are always older than spilled ones, so the spill is only read once the ring is empty
+        portENTER_CRITICAL(&spill_lock);
+        bool spilling = spill_active;
+        portEXIT_CRITICAL(&spill_lock);
+
+        rx_chunk = rx_ring.peek(&rx_chunk_len);
+        for (TickType_t start = xTaskGetTickCount(); rx_chunk == nullptr && !spilling && xTaskGetTickCount() - start < wait_ticks;) {
+            vTaskDelay(1);
+            rx_chunk = rx_ring.peek(&rx_chunk_len);
+        }
+
+        if (rx_chunk == nullptr) {
+            // Nothing of the ring is held any more, give the producer all of it back
+            rx_ring.release();
+            return spill_peek();
+        }
+
+        rx_chunk_pos = 0;
+    }
+
+    return (const line_batch *)(rx_chunk + rx_chunk_pos);
+}
+
+void uart_manager::finish_batch(const line_batch *batch)
+{
+    // Only the head spill block can be handed out, anything inside it came from the spill
+    spill_block *head = spill_head;
+    if (head != nullptr && (uint8_t *)batch > (uint8_t *)head && (uint8_t *)batch < (uint8_t *)head + spill_pool::BLOCK_SIZE) {
+        spill_release(batch);
+        return;
+    }
+
+    rx_chunk_pos += batch->size;
+    if (rx_chunk_pos + sizeof(line_batch) > rx_chunk_len || ((line_batch *)(rx_chunk + rx_chunk_pos))->size == 0) {
+        rx_chunk = nullptr;
+        if (rx_ring.get_unreleased() >= RELEASE_BATCH_SIZE) {
+            rx_ring.release();
+        }
+    }
+}
+
+esp_err_t uart_manager::wait_for_newline(uint8_t **buf, size_t *len_out, int64_t *ts_out, uint32_t wait_ticks)
 {
     if (buf == nullptr || len_out == nullptr) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    void *out = xRingbufferReceive(rx_ringbuf, len_out, wait_ticks);
-    if (out == nullptr) {
-        return ESP_ERR_TIMEOUT;
+    // Walks the batch in place, the same line comes back until it's finished
+    if (rx_batch == nullptr) {
+        rx_batch = wait_for_batch(wait_ticks);
+        rx_line = 0;
+        if (rx_batch == nullptr) {
+            return ESP_ERR_TIMEOUT;
+        }
     }
 
-    *buf = (uint8_t *)out;
+    const uint8_t *line = nullptr;
+    *len_out = rx_batch->get_line(rx_line, &line, ts_out);
+    *buf = (uint8_t *)line;
     return ESP_OK;
 }
 
 void uart_manager::finish_newline(uint8_t *buf)
 {
-    vRingbufferReturnItem(rx_ringbuf, buf);
+    if (++rx_line == rx_batch->line_cnt) {
+        finish_batch(rx_batch);
+        rx_batch = nullptr;
+    }
+}
+
+void uart_manager::get_rx_stats(uart_rx_stats &stats_out)
+{
+    portENTER_CRITICAL(&spill_lock);
+    stats_out = rx_stats;
+    portEXIT_CRITICAL(&spill_lock);
+}
+
+uint8_t *uart_manager::ring_reserve(size_t len, uint32_t wait_ticks)
+{
+    // The ring has nothing to block on, a full one is polled once a tick
+    uint8_t *rec = rx_ring.reserve(len);
+    for (TickType_t start = xTaskGetTickCount(); rec == nullptr && xTaskGetTickCount() - start < wait_ticks;) {
+        vTaskDelay(1);
+        rec = rx_ring.reserve(len);
+    }
+
+    return rec;
+}
+
+line_batch *uart_manager::acquire_batch(size_t data_len, uint32_t line_cnt, line_dest &dest)
+{
+    portENTER_CRITICAL(&spill_lock);
+    rx_stats.line_cnt += line_cnt;
+    portEXIT_CRITICAL(&spill_lock);
+
+    // Batches collect in internal RAM while the burst lasts, PSRAM only sees the whole stage at once
+    size_t batch_size = line_batch::size_for(data_len, line_cnt);
+    line_batch *batch = nullptr;
+    if (batch_size <= RX_STAGE_SIZE) {
+        if (stage_used + batch_size > RX_STAGE_SIZE) {
+            flush_stage();
+        }
+
+        batch = (line_batch *)(stage + stage_used);
+        dest = LINE_DEST_STAGE;
+    } else {
+        // Bigger than the stage: it gets a chunk of its own, behind whatever is staged
+        flush_stage();
+        portENTER_CRITICAL(&spill_lock);
+        bool spilling = spill_active;
+        portEXIT_CRITICAL(&spill_lock);
+
+        size_t chunk_len = chunk_len_for(batch_size);
+        direct_chunk = spilling ? nullptr : ring_reserve(chunk_len, 0);
+        if (direct_chunk != nullptr) {
+            batch = (line_batch *)direct_chunk;
+            dest = LINE_DEST_RING;
+        } else if ((batch = spill_reserve(batch_size)) != nullptr) {
+            // Ring is full (or already spilling): park the batch in the shared pool while the writer catches up
+            dest = LINE_DEST_SPILL;
+        } else {
+            // Pool exhausted too; waiting on the ring is only safe while nothing is parked ahead of it
+            portENTER_CRITICAL(&spill_lock);
+            spilling = spill_active;
+            portEXIT_CRITICAL(&spill_lock);
+
+            direct_chunk = spilling ? nullptr : ring_reserve(chunk_len, pdMS_TO_TICKS(300));
+            if (direct_chunk == nullptr) {
+                drop_lines(line_cnt);
+                return nullptr;
+            }
+
+            batch = (line_batch *)direct_chunk;
+            dest = LINE_DEST_RING;
+        }
+    }
+
+    batch->size = batch_size;
+    batch->line_cnt = line_cnt;
+    return batch;
+}
+
+void uart_manager::commit_batch(line_batch *batch, line_dest dest)
+{
+    switch (dest) {
+        case LINE_DEST_STAGE:
+            stage_used += batch->size;
+            break;
+
+        case LINE_DEST_RING: {
+            size_t chunk_len = chunk_len_for(batch->size);
+            if (chunk_len > batch->size) {
+                ((line_batch *)(direct_chunk + batch->size))->size = 0;
+            }
+
+            rx_ring.commit();
+            direct_chunk = nullptr;
+            break;
+        }
+
+        case LINE_DEST_SPILL:
+            spill_commit(batch);
+            break;
+    }
+}
+
+void uart_manager::abort_batch(line_batch *batch, line_dest dest)
+{
+    // Nothing of it was published, so its lines count as dropped
+    drop_lines(batch->line_cnt);
+    switch (dest) {
+        case LINE_DEST_STAGE:
+            break; // stage_used only moves on commit
+
+        case LINE_DEST_RING:
+            rx_ring.abort();
+            direct_chunk = nullptr;
+            break;
+
+        case LINE_DEST_SPILL:
+            spill_abort();
+            break;
+    }
+}
+
+void uart_manager::flush_stage()
+{
+    if (stage_used == 0) {
+        return;
+    }
+
+    portENTER_CRITICAL(&spill_lock);
+    bool spilling = spill_active;
+    portEXIT_CRITICAL(&spill_lock);
+
+    // One reserve and one sequential copy into PSRAM for the whole burst
+    size_t chunk_len = chunk_len_for(stage_used);
+    size_t pos = 0;
+    uint8_t *chunk = spilling ? nullptr : ring_reserve(chunk_len, 0);
+    if (chunk == nullptr) {
+        // Ring is full (or already spilling): the batches go to the pool one by one, same as unstaged ones would
+        while (pos < stage_used) {
+            auto *batch = (line_batch *)(stage + pos);
+            line_batch *spilled = spill_reserve(batch->size);
+            if (spilled == nullptr) {
+                break;
+            }
+
+            memcpy(spilled, batch, batch->size);
+            spill_commit(spilled);
+            pos += batch->size;
+        }
+
+        // Pool exhausted too; waiting on the ring is only safe while nothing is parked ahead of it
+        portENTER_CRITICAL(&spill_lock);
+        spilling = spill_active;
+        portEXIT_CRITICAL(&spill_lock);
+
+        chunk_len = chunk_len_for(stage_used - pos);
+        if (pos < stage_used && !spilling) {
+            chunk = ring_reserve(chunk_len, pdMS_TO_TICKS(300));
+        }
+    }
+
+    if (chunk != nullptr) {
+        memcpy(chunk, stage + pos, stage_used - pos);
+        if (chunk_len > stage_used - pos) {
+            ((line_batch *)(chunk + stage_used - pos))->size = 0;
+        }
+
+        rx_ring.commit();
+        pos = stage_used;
+    }
+
+    if (pos < stage_used) {
+        uint32_t lost = 0;
+        for (; pos < stage_used; pos += ((line_batch *)(stage + pos))->size) {
+            lost += ((line_batch *)(stage + pos))->line_cnt;
+        }
+
+        ESP_LOGW(TAG, "UART%d ring and spill full, %lu line(s) dropped", uart_port, lost);
+        drop_lines(lost);
+    }
+
+    stage_used = 0;
+}
+
+void uart_manager::drop_lines(uint32_t count)
+{
+    portENTER_CRITICAL(&spill_lock);
+    rx_stats.dropped_cnt += count;
+    portEXIT_CRITICAL(&spill_lock);
+}
+
+line_batch *uart_manager::spill_reserve(size_t batch_size)
+{
+    if (batch_size > spill_pool::BLOCK_SIZE - sizeof(spill_block)) {
+        return nullptr;
+    }
+
+    // While spill_writing is set the consumer leaves the tail block alone
+    portENTER_CRITICAL(&spill_lock);
+    spill_writing = true;
+    spill_block *tail = spill_tail;
+    portEXIT_CRITICAL(&spill_lock);
+
+    if (tail == nullptr || spill_pool::BLOCK_SIZE - sizeof(spill_block) - tail->used < batch_size) {
+        auto *block = (spill_block *)spill_pool::instance()->alloc_block();
+        if (block == nullptr) {
+            spill_abort();
+            return nullptr;
+        }
+
+        block->next = nullptr;
+        block->used = 0;
+        block->read_pos = 0;
+
+        portENTER_CRITICAL(&spill_lock);
+        if (spill_tail != nullptr) {
+            spill_tail->next = block;
+        } else {
+            spill_head = block;
+        }
+
+        spill_tail = block;
+        spill_active = true;
+        portEXIT_CRITICAL(&spill_lock);
+        tail = block;
+    }
+
+    return (line_batch *)((uint8_t *)(tail + 1) + tail->used);
+}
+
+void uart_manager::spill_commit(const line_batch *batch)
+{
+    portENTER_CRITICAL(&spill_lock);
+    spill_tail->used += batch->size;
+    spill_writing = false;
+    rx_stats.spilled_cnt += batch->line_cnt;
+    rx_stats.spill_depth += batch->size;
+    if (rx_stats.spill_depth > rx_stats.spill_peak) {
+        rx_stats.spill_peak = rx_stats.spill_depth;
+    }
+    portEXIT_CRITICAL(&spill_lock);
+}
+
+void uart_manager::spill_abort()
+{
+    portENTER_CRITICAL(&spill_lock);
+    spill_writing = false;
+    portEXIT_CRITICAL(&spill_lock);
+}
+
+const line_batch *uart_manager::spill_peek()
+{
+    const line_batch *batch = nullptr;
+
+    portENTER_CRITICAL(&spill_lock);
+    spill_block *drained = spill_pop_drained();
+    if (spill_head != nullptr && spill_head->read_pos < spill_head->used) {
+        batch = (const line_batch *)((uint8_t *)(spill_head + 1) + spill_head->read_pos);
+    }
+    portEXIT_CRITICAL(&spill_lock);
+
+    spill_pool::instance()->free_block(drained);
+    return batch;
+}
+
+void uart_manager::spill_release(const line_batch *batch)
+{
+    portENTER_CRITICAL(&spill_lock);
+    spill_head->read_pos += batch->size;
+    rx_stats.spill_depth -= batch->size;
+    spill_block *drained = spill_pop_drained();
+    portEXIT_CRITICAL(&spill_lock);
+
+    spill_pool::instance()->free_block(drained);
+}
+
+uart_manager::spill_block *uart_manager::spill_pop_drained()
+{
+    // Called under spill_lock; the caller hands the returned block back to the pool once unlocked
+    spill_block *head = spill_head;
+    if (head == nullptr || head->read_pos < head->used) {
+        return nullptr;
+    }
+
+    if (head->next != nullptr) {
+        spill_head = head->next;
+        return head;
+    }
+
+    if (spill_writing) {
+        return nullptr;
+    }
+
+    // Caught up completely, new lines can go back to the ring
+    spill_head = nullptr;
+    spill_tail = nullptr;
+    spill_active = false;
+    return head;
+}
+
+void uart_manager::capture_lines()
+{
+    // Every line the driver has a position for goes out in one read, as one batch.
+    // Positions lost to a full pattern queue just leave their newline inside a longer line.
+    uint32_t ends[PATTERN_QUEUE_LEN] = {};
+    uint32_t line_cnt = 0;
+    for (int pos = 0; line_cnt < PATTERN_QUEUE_LEN && (pos = uart_pattern_pop_pos(uart_port)) >= 0;) {
+        // Take the '\n' along with the line, otherwise it ends up in front of the next one
+        if (line_cnt > 0 && (uint32_t)pos < ends[line_cnt - 1]) {
+            break;
+        }
+
+        ends[line_cnt++] = pos + 1;
+    }
+
+    if (line_cnt == 0) {
+        return; // Already read along with an earlier event's lines
+    }
+
+    struct timeval val = {};
+    gettimeofday(&val, nullptr);
+
+    char ts_str[128] = { 0 };
+    size_t ts_len = 0;
+    if (enable_timestamp) {
+        snprintf(ts_str, sizeof(ts_str), "[%lld%06ld] ", val.tv_sec, val.tv_usec);
+        ts_str[sizeof(ts_str) - 1] = '\0';
+        ts_len = strnlen(ts_str, sizeof(ts_str));
+    }
+
+    size_t read_len = ends[line_cnt - 1];
+    size_t prefix_len = ts_len * line_cnt;
+    line_dest dest = LINE_DEST_STAGE;
+    line_batch *batch = acquire_batch(prefix_len + read_len, line_cnt, dest);
+    if (batch == nullptr) {
+        ESP_LOGW(TAG, "UART%d failed to allocate ringbuffer, giving up len=%u", uart_port, read_len);
+        uart_flush_input(uart_port);
+        return;
+    }
+
+    // Read in behind room for the prefixes, so they can be slid in without a second buffer
+    uint8_t *data = batch->data();
+    int read_ret = uart_read_bytes(uart_port, data + prefix_len, read_len, pdMS_TO_TICKS(300));
+    if (read_ret < 0) {
+        ESP_LOGW(TAG, "UART%d failed to read: %d", uart_port, read_ret);
+        abort_batch(batch, dest);
+        uart_flush_input(uart_port); // Try to reset...
+        return;
+    }
+
+    // A short read only keeps the lines it got whole, what's left of the rest ends up in front of the next line
+    uint32_t whole_cnt = 0;
+    while (whole_cnt < line_cnt && ends[whole_cnt] <= (uint32_t)read_ret) {
+        whole_cnt++;
+    }
+
+    if (whole_cnt < line_cnt) {
+        ESP_LOGW(TAG, "UART%d short read, %d of %u bytes, %lu line(s) dropped", uart_port, read_ret, read_len, line_cnt - whole_cnt);
+        if (whole_cnt == 0) {
+            abort_batch(batch, dest);
+            return;
+        }
+
+        drop_lines(line_cnt - whole_cnt);
+        line_cnt = whole_cnt;
+        batch->line_cnt = whole_cnt;
+    }
+
+    // Earlier lines were complete a wire time before the read
+    batch->hdr.ts_us = (int64_t)val.tv_sec * 1000000 + val.tv_usec;
+    line_end *line_ends = batch->ends();
+    size_t out = 0;
+    for (uint32_t idx = 0, start = 0; idx < line_cnt; start = ends[idx++]) {
+        if (ts_len > 0) {
+            memcpy(data + out, ts_str, ts_len);
+            memmove(data + out + ts_len, data + prefix_len + start, ends[idx] - start);
+            out += ts_len;
+        }
+
+        out += ends[idx] - start;
+        line_ends[idx].end = out;
+        line_ends[idx].ts_back_us = wire_time_us(read_len - ends[idx]);
+    }
+
+    commit_batch(batch, dest);
+}
+
+void uart_manager::capture_run(size_t len, bool idle_end)
+{
+    struct timeval val = {};
+    gettimeofday(&val, nullptr);
+
+    // Stamp the run with its first byte: back off by the wire time of the bytes, plus the idle gap if that's what ended it
+    int64_t ts_us = (int64_t)val.tv_sec * 1000000 + val.tv_usec - wire_time_us(len + (idle_end ? idle_symbols : 0));
+    if (ts_us < last_run_ts_us) {
+        ts_us = last_run_ts_us; // Estimates of back-to-back runs can overlap, keep one direction in order
+    }
+
+    last_run_ts_us = ts_us;
+
+    line_dest dest = LINE_DEST_STAGE;
+    line_batch *batch = acquire_batch(len, 1, dest);
+    if (batch == nullptr) {
+        ESP_LOGW(TAG, "UART%d failed to allocate ringbuffer, giving up len=%u", uart_port, len);
+        uart_flush_input(uart_port);
+        return;
+    }
+
+    batch->hdr.ts_us = ts_us;
+    int read_ret = uart_read_bytes(uart_port, batch->data(), len, pdMS_TO_TICKS(300));
+    if (read_ret <= 0) {
+        ESP_LOGW(TAG, "UART%d failed to read: %d", uart_port, read_ret);
+        abort_batch(batch, dest);
+        uart_flush_input(uart_port);
+        return;
+    }
+
+    // A short read keeps what arrived, the run just ends early
+    batch->ends()[0] = { (uint32_t)read_ret, 0 };
+    commit_batch(batch, dest);
+}
+
+uint32_t uart_manager::frame_half_bits() const
+{
+    // Counted in half bits to cover 1.5 stop bits
+    uint32_t half_bits = 2 * (1 + 5 + (uint32_t)uart_cfg.data_bits);
+    half_bits += uart_cfg.parity != UART_PARITY_DISABLE ? 2 : 0;
+    half_bits += uart_cfg.stop_bits == UART_STOP_BITS_2 ? 4 : (uart_cfg.stop_bits == UART_STOP_BITS_1_5 ? 3 : 2);
+    return half_bits;
+}
+
+int64_t uart_manager::wire_time_us(uint64_t symbols) const
+{
+    return uart_cfg.baud_rate > 0 ? (int64_t)(symbols * frame_half_bits() * 500000 / uart_cfg.baud_rate) : 0;
+}
+
+uint32_t uart_manager::get_ingest_rate() const
+{
+    // Worst case bytes/s on a saturated line
+    return (uint32_t)(((uint64_t)uart_cfg.baud_rate * 2) / frame_half_bits());
+}
+
+int64_t uart_manager::get_run_delay_us() const
+{
+    // A run is stamped at its first byte but only shows up once a FIFO's worth arrived or the line went idle
+    return capture_runs ? wire_time_us(RUN_FIFO_THRESHOLD + idle_symbols) : 0;
 }
 
 void uart_manager::toggle_timestamp_prepend(bool enable)
 {
     enable_timestamp = enable;
 }
+
+void uart_manager::set_run_capture(uint8_t _idle_symbols)
+{
+    // Has to come before init(), the driver is set up for one or the other; 0 goes back to lines
+    capture_runs = _idle_symbols > 0;
+    idle_symbols = _idle_symbols;
+}
+
+#ifdef CONFIG_SL_RING_BENCH_AT_BOOT
+esp_err_t uart_manager::run_ingest_bench()
+{
+    // Same lines three ways over the same PSRAM storage: one NOSPLIT ringbuffer item per line, one spsc_ring
+    // record per line, and as batches of a few lines through the stage, the way captured lines go.
+    // No UART involved, just the ring operations and the copies.
+    static const size_t line_sizes[] = { 20, 80, 256 };
+    static const size_t BENCH_BYTES = 512 * 1024;
+    static const uint32_t READ_LINES = 8; // Lines per bulk read in the batched pass
+
+    uart_manager bench("ring_bench", UART_NUM_MAX);
+    esp_err_t ret = bench.alloc_buffers();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Bench: can't allocate buffers");
+        return ret;
+    }
+
+    uint8_t src[256] = {};
+    memset(src, 'x', sizeof(src));
+    for (auto line_size : line_sizes) {
+        uint32_t lines = BENCH_BYTES / line_size;
+        size_t item_len = sizeof(line_hdr) + line_size;
+
+        StaticRingbuffer_t nosplit_struct = {};
+        RingbufHandle_t nosplit = xRingbufferCreateStatic(RX_RINGBUF_SIZE, RINGBUF_TYPE_NOSPLIT, bench.ring_storage, &nosplit_struct);
+        uint32_t start = esp_cpu_get_cycle_count();
+        for (uint32_t idx = 0; idx < lines; idx++) {
+            uint8_t *buf = nullptr;
+            if (xRingbufferSendAcquire(nosplit, (void **)&buf, item_len, 0) != pdTRUE || buf == nullptr) {
+                break;
+            }
+
+            ((line_hdr *)buf)->ts_us = idx;
+            memcpy(buf + sizeof(line_hdr), src, line_size);
+            xRingbufferSendComplete(nosplit, buf);
+        }
+        uint32_t nosplit_cycles = esp_cpu_get_cycle_count() - start;
+        // GetCurFreeSize() is capped at the largest item, the item offsets aren't
+        UBaseType_t free_off = 0;
+        UBaseType_t acquire_off = 0;
+        vRingbufferGetInfo(nosplit, &free_off, nullptr, nullptr, &acquire_off, nullptr);
+        size_t nosplit_used = (acquire_off + RX_RINGBUF_SIZE - free_off) % RX_RINGBUF_SIZE;
+
+        size_t rx_len = 0;
+        start = esp_cpu_get_cycle_count();
+        while (void *item = xRingbufferReceive(nosplit, &rx_len, 0)) {
+            vRingbufferReturnItem(nosplit, item);
+        }
+        uint32_t nosplit_rx_cycles = esp_cpu_get_cycle_count() - start;
+        vRingbufferDelete(nosplit);
+
+        bench.rx_ring.init(bench.ring_storage, RX_RINGBUF_SIZE);
+        start = esp_cpu_get_cycle_count();
+        for (uint32_t idx = 0; idx < lines; idx++) {
+            uint8_t *buf = bench.rx_ring.reserve(item_len);
+            if (buf == nullptr) {
+                break;
+            }
+
+            ((line_hdr *)buf)->ts_us = idx;
+            memcpy(buf + sizeof(line_hdr), src, line_size);
+            bench.rx_ring.commit();
+        }
+        uint32_t spsc_cycles = esp_cpu_get_cycle_count() - start;
+        size_t spsc_used = bench.rx_ring.get_used();
+
+        start = esp_cpu_get_cycle_count();
+        while (bench.rx_ring.peek(&rx_len) != nullptr) {
+        }
+        bench.rx_ring.release();
+        uint32_t spsc_rx_cycles = esp_cpu_get_cycle_count() - start;
+
+        bench.rx_ring.init(bench.ring_storage, RX_RINGBUF_SIZE);
+        start = esp_cpu_get_cycle_count();
+        for (uint32_t idx = 0; idx < lines; idx += READ_LINES) {
+            uint32_t line_cnt = lines - idx < READ_LINES ? lines - idx : READ_LINES;
+            line_dest dest = LINE_DEST_STAGE;
+            line_batch *batch = bench.acquire_batch(line_cnt * line_size, line_cnt, dest);
+            if (batch == nullptr) {
+                break;
+            }
+
+            batch->hdr.ts_us = idx + line_cnt - 1;
+            line_end *ends = batch->ends();
+            for (uint32_t line = 0; line < line_cnt; line++) {
+                memcpy(batch->data() + line * line_size, src, line_size);
+                ends[line] = { (line + 1) * (uint32_t)line_size, line_cnt - 1 - line };
+            }
+
+            bench.commit_batch(batch, dest);
+        }
+        bench.flush_stage();
+        uint32_t batched_cycles = esp_cpu_get_cycle_count() - start;
+        size_t batched_used = bench.rx_ring.get_used();
+
+        uint8_t *line = nullptr;
+        size_t line_len = 0;
+        start = esp_cpu_get_cycle_count();
+        while (bench.wait_for_newline(&line, &line_len, nullptr, 0) == ESP_OK) {
+            bench.finish_newline(line);
+        }
+        uint32_t batched_rx_cycles = esp_cpu_get_cycle_count() - start;
+
+        ESP_LOGI(TAG, "Bench %3u B lines, cycles/line in+out and ring B/line: nosplit %lu+%lu %u, spsc %lu+%lu %u, batched %lu+%lu %u",
+                 line_size, nosplit_cycles / lines, nosplit_rx_cycles / lines, nosplit_used / lines, spsc_cycles / lines, spsc_rx_cycles / lines,
+                 spsc_used / lines, batched_cycles / lines, batched_rx_cycles / lines, batched_used / lines);
+    }
+
+    bench.free_buffers();
+    return ESP_OK;
+}
+#endif
@@ -1,38 +1,169 @@
 #pragma once
 
+#include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <driver/uart.h>
 #include <driver/gpio.h>
-#include <freertos/ringbuf.h>
+#include "spsc_ring.hpp"
+
+// Every captured line starts with its capture time; 4-aligned, so records need no padding in front of it
+struct __attribute__((packed, aligned(4))) line_hdr
+{
+    int64_t ts_us;
+};
+
+struct line_end
+{
+    uint32_t end; // Offset just past the line in the batch data
+    uint32_t ts_back_us; // How long before the batch timestamp the line was complete
+};
+
+// Lines from one bulk read: this header, the line bytes back to back, then one line_end per line, 4-aligned
+struct line_batch
+{
+    uint32_t size; // Header, data and table, 0 ends a chunk early
+    uint32_t line_cnt;
+    line_hdr hdr; // Capture time of the last line
+
+    uint8_t *data() { return (uint8_t *)(this + 1); }
+    const uint8_t *data() const { return (const uint8_t *)(this + 1); }
+    line_end *ends() { return (line_end *)((uint8_t *)this + size) - line_cnt; }
+    const line_end *ends() const { return (const line_end *)((const uint8_t *)this + size) - line_cnt; }
+    size_t get_line(uint32_t idx, const uint8_t **buf_out, int64_t *ts_out) const
+    {
+        uint32_t start = idx > 0 ? ends()[idx - 1].end : 0;
+        *buf_out = data() + start;
+        if (ts_out != nullptr) {
+            *ts_out = hdr.ts_us - ends()[idx].ts_back_us;
+        }
+
+        return ends()[idx].end - start;
+    }
+
+    static constexpr size_t size_for(size_t data_len, uint32_t line_cnt)
+    {
+        return ((sizeof(line_batch) + data_len + 3) & ~(size_t)3) + line_cnt * sizeof(line_end);
+    }
+};
+
+struct uart_rx_stats
+{
+    uint32_t line_cnt;
+    uint32_t dropped_cnt;
+    uint32_t spilled_cnt; // Lines that went through the spill pool instead of the ring
+    uint32_t spill_depth; // Bytes currently parked in spill blocks
+    uint32_t spill_peak;
+};
 
 class uart_manager
 {
 public:
     explicit uart_manager(const char *_name = "uart0", uart_port_t _port = UART_NUM_0) : task_name(_name), uart_port(_port) {}
     esp_err_t init();
+    esp_err_t apply_config(uint32_t changes);
+    void stop();
     static void uart_event_task(void *_ctx);
+    const line_batch *wait_for_batch(uint32_t wait_ticks); // Either whole batches or line by line below, not both
+    void finish_batch(const line_batch *batch);
     esp_err_t wait_for_newline(uint8_t **buf, size_t *len_out, uint32_t wait_ticks = portMAX_DELAY);
+    esp_err_t wait_for_newline(uint8_t **buf, size_t *len_out, int64_t *ts_out, uint32_t wait_ticks);
     void finish_newline(uint8_t *buf);
     void toggle_timestamp_prepend(bool enable);
+    void set_run_capture(uint8_t _idle_symbols);
+    uart_port_t get_port() const { return uart_port; }
+    bool is_running() const { return evt_task_handle != nullptr; }
+    uint32_t get_ingest_rate() const;
+    int64_t get_run_delay_us() const;
+    size_t get_ring_size() const { return RX_RINGBUF_SIZE; }
+    void get_rx_stats(uart_rx_stats &stats_out);
+#ifdef CONFIG_SL_RING_BENCH_AT_BOOT
+    static esp_err_t run_ingest_bench();
+#endif
+
+private:
+    // Spilled batches are packed back to back in pool blocks, each block is consumed front to back
+    struct spill_block
+    {
+        spill_block *next;
+        uint32_t used; // Committed bytes, the consumer never reads past this
+        uint32_t read_pos;
+        uint32_t reserved;
+    };
+
+    enum line_dest : uint8_t
+    {
+        LINE_DEST_STAGE = 0,
+        LINE_DEST_RING, // Too big for the stage, gets a chunk of its own
+        LINE_DEST_SPILL,
+    };
+
+    void capture_lines();
+    void capture_run(size_t len, bool idle_end);
+    uint32_t frame_half_bits() const;
+    int64_t wire_time_us(uint64_t symbols) const;
+    esp_err_t alloc_buffers();
+    void free_buffers();
+    uint8_t *ring_reserve(size_t len, uint32_t wait_ticks);
+    line_batch *acquire_batch(size_t data_len, uint32_t line_cnt, line_dest &dest);
+    void commit_batch(line_batch *batch, line_dest dest);
+    void abort_batch(line_batch *batch, line_dest dest);
+    void flush_stage();
+    void drop_lines(uint32_t count);
+    line_batch *spill_reserve(size_t batch_size);
+    void spill_commit(const line_batch *batch);
+    void spill_abort();
+    const line_batch *spill_peek();
+    void spill_release(const line_batch *batch);
+    spill_block *spill_pop_drained();
+    static size_t chunk_len_for(size_t used)
+    {
+        // Record header plus chunk fill whole cache lines, so chunks never share a line and PSRAM sees whole-line writes
+        return ((used + spsc_ring::HDR_SIZE + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)) - spsc_ring::HDR_SIZE;
+    }
 
 private:
     const char *task_name;
-    bool enable_timestamp = true;
+    bool enable_timestamp = false; // Capture time is kept in binary anyway, text prefix is opt-in
+    bool capture_runs = false; // Sniffer: raw byte runs split at idle gaps instead of lines
+    uint8_t idle_symbols = 0;
+    int64_t last_run_ts_us = 0;
     uart_port_t uart_port;
     gpio_num_t pin_tx = GPIO_NUM_NC;
     gpio_num_t pin_rx = GPIO_NUM_NC;
     gpio_num_t pin_rts = GPIO_NUM_NC;
     gpio_num_t pin_cts = GPIO_NUM_NC;
     QueueHandle_t uart_queue = nullptr;
-    RingbufHandle_t rx_ringbuf = nullptr;
-    TaskHandle_t evt_task_handle = nullptr;
+    spsc_ring rx_ring; // Event task produces, writer task consumes
+    uint8_t *ring_storage = nullptr; // PSRAM, cache line aligned
+    uint8_t *stage = nullptr; // Internal RAM, lines collect here during a burst, event task only
+    size_t stage_used = 0;
+    uint8_t *direct_chunk = nullptr; // LINE_DEST_RING record between acquire and commit
+    uint8_t *rx_chunk = nullptr; // Consumer: chunk being handed out batch by batch
+    size_t rx_chunk_len = 0;
+    size_t rx_chunk_pos = 0;
+    const line_batch *rx_batch = nullptr; // Consumer: batch being handed out line by line
+    uint32_t rx_line = 0;
+    TaskHandle_t evt_task_handle = nullptr; // Cleared by the event task itself on stop()
     uart_config_t uart_cfg = {};
+    portMUX_TYPE spill_lock = portMUX_INITIALIZER_UNLOCKED;
+    spill_block *spill_head = nullptr;
+    spill_block *spill_tail = nullptr;
+    bool spill_active = false; // Once set, new lines go to the spill blocks until they've all been drained, to keep order
+    bool spill_writing = false;
+    uart_rx_stats rx_stats = {};
 
 private:
     static const constexpr size_t TX_BUF_SIZE = 256;
     static const constexpr size_t RX_BUF_SIZE = 8192;
-    static const constexpr size_t RX_RINGBUF_SIZE = 2097152; // 2MB
+    static const constexpr size_t RX_RINGBUF_SIZE = 2097152; // 2MB, has to be a power of two
+    static const constexpr size_t RX_STAGE_SIZE = 4096;
+    static const constexpr uint32_t PATTERN_QUEUE_LEN = 20; // Also the most lines one bulk read takes
+    static const constexpr int RUN_FIFO_THRESHOLD = 120; // Bytes of a long run the FIFO collects before handing them over
+    static const constexpr size_t CACHE_LINE_SIZE = 64; // Covers both data cache line settings on the S3
+    static const constexpr size_t RELEASE_BATCH_SIZE = 65536; // Consumed chunks go back to the producer in batches of this much
+    static const constexpr uint32_t STOP_WAIT_MS = 1000;
+    static const constexpr BaseType_t INGEST_CORE = PRO_CPU_NUM; // Writer & compression run on the other core
     static const constexpr char TAG[] = "uart_wrapper";
 };
 
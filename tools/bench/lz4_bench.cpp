@@ -0,0 +1,85 @@
+// Compression ratio vs. CPU time of the firmware LZ4 codec on real captures.
+// Build: g++ -O2 -I../../main -o lz4_bench lz4_bench.cpp ../../main/lz4_codec.cpp
+// Usage: ./lz4_bench capture.txt [more captures...]
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "lz4_codec.hpp"
+
+static const size_t BLOCK_SIZES[] = { 4096, 8192, 16384, 32768, 65536 };
+
+static bool read_file(const char *path, std::vector<uint8_t> &out)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    uint8_t chunk[65536];
+    size_t read_len = 0;
+    while ((read_len = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        out.insert(out.end(), chunk, chunk + read_len);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s capture [capture...]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> input;
+    for (int idx = 1; idx < argc; idx++) {
+        if (!read_file(argv[idx], input)) {
+            fprintf(stderr, "Can't read %s\n", argv[idx]);
+            return 1;
+        }
+    }
+
+    if (input.empty()) {
+        fprintf(stderr, "Nothing to compress\n");
+        return 1;
+    }
+
+    static lz4_codec codec;
+    std::vector<uint8_t> out(lz4_codec::compress_bound(lz4_codec::MAX_BLOCK_SIZE));
+    std::vector<uint8_t> check(lz4_codec::MAX_BLOCK_SIZE);
+
+    printf("%10s %12s %12s %8s %12s %12s\n", "block", "raw", "stored", "ratio", "comp MB/s", "decomp MB/s");
+    for (size_t block_size : BLOCK_SIZES) {
+        size_t stored = 0;
+        double comp_sec = 0, decomp_sec = 0;
+
+        for (size_t pos = 0; pos < input.size(); pos += block_size) {
+            size_t len = std::min(block_size, input.size() - pos);
+
+            auto start = std::chrono::steady_clock::now();
+            size_t comp_len = codec.compress(input.data() + pos, len, out.data(), out.size());
+            auto mid = std::chrono::steady_clock::now();
+            int32_t dec_len = lz4_codec::decompress(out.data(), comp_len, check.data(), check.size());
+            auto end = std::chrono::steady_clock::now();
+
+            if (dec_len != (int32_t)len || memcmp(check.data(), input.data() + pos, len) != 0) {
+                fprintf(stderr, "Round trip mismatch at offset %zu\n", pos);
+                return 2;
+            }
+
+            // Same rule as the firmware: incompressible blocks are stored raw
+            stored += std::min(comp_len, len);
+            comp_sec += std::chrono::duration<double>(mid - start).count();
+            decomp_sec += std::chrono::duration<double>(end - mid).count();
+        }
+
+        double mb = (double)input.size() / 1048576.0;
+        printf("%10zu %12zu %12zu %8.2f %12.1f %12.1f\n", block_size, input.size(), stored,
+               (double)input.size() / (double)stored, mb / comp_sec, mb / decomp_sec);
+    }
+
+    return 0;
+}
@@ -0,0 +1 @@
+"""Host-side helpers for reading soullogger captures."""
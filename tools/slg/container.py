@@ -0,0 +1,212 @@
+"""Reader for the segment container defined in main/log_format.hpp."""
+
+import struct
+import zlib
+from dataclasses import dataclass
+
+from . import lz4
+
+FILE_MAGIC = 0x46474C53   # "SLGF"
+BLOCK_MAGIC = 0x42474C53  # "SLGB"
+
+CODEC_NONE = 0
+CODEC_LZ4 = 1
+CODEC_NAMES = {CODEC_NONE: "none", CODEC_LZ4: "lz4"}
+
+BLOCK_FLAG_GAP = 0x0001
+BLOCK_FLAG_TAGGED = 0x0002
+
+FILE_HEADER = struct.Struct("<IHBBIq32sIII")
+BLOCK_HEADER = struct.Struct("<IBBHIqqIIIII")
+RECORD_HEADER = struct.Struct("<IH")
+GAP_RECORD = struct.Struct("<qqII")
+
+assert FILE_HEADER.size == 64 and BLOCK_HEADER.size == 48 and RECORD_HEADER.size == 6
+assert GAP_RECORD.size == 24
+
+
+class FormatError(ValueError):
+    pass
+
+
+@dataclass
+class FileHeader:
+    offset: int
+    version: int
+    channel: int
+    boot_id: int
+    created_us: int
+    fw_version: str
+    config: bytes
+
+
+@dataclass
+class BlockHeader:
+    offset: int
+    channel: int
+    codec: int
+    flags: int
+    seq: int
+    first_ts_us: int
+    last_ts_us: int
+    record_count: int
+    raw_len: int
+    stored_len: int
+    payload_crc: int
+
+    @property
+    def is_gap(self):
+        return bool(self.flags & BLOCK_FLAG_GAP)
+
+    @property
+    def is_tagged(self):
+        """Records start with their source channel byte (merged segment)."""
+        return bool(self.flags & BLOCK_FLAG_TAGGED)
+
+    @property
+    def payload_offset(self):
+        return self.offset + BLOCK_HEADER.size
+
+    @property
+    def end_offset(self):
+        return self.payload_offset + self.stored_len
+
+
+@dataclass
+class Gap:
+    offline_us: int
+    online_us: int
+    dropped_lines: int
+
+
+@dataclass
+class Corruption:
+    offset: int
+    reason: str
+
+
+def _parse_file_header(fp, offset, raw):
+    (magic, version, channel, _, boot_id, created_us, fw_version,
+     config_len, config_crc, header_crc) = FILE_HEADER.unpack(raw)
+    if zlib.crc32(raw[:-4]) != header_crc:
+        raise FormatError("file header CRC mismatch")
+
+    config = fp.read(config_len)
+    if len(config) < config_len:
+        raise FormatError("truncated config snapshot")
+    if zlib.crc32(config) != config_crc:
+        raise FormatError("config snapshot CRC mismatch")
+
+    return FileHeader(offset, version, channel, boot_id, created_us,
+                      fw_version.split(b"\0", 1)[0].decode(errors="replace"), config)
+
+
+def _parse_block_header(offset, raw):
+    (magic, channel, codec, flags, seq, first_ts, last_ts, record_count,
+     raw_len, stored_len, payload_crc, header_crc) = BLOCK_HEADER.unpack(raw)
+    if zlib.crc32(raw[:-4]) != header_crc:
+        raise FormatError("block header CRC mismatch")
+
+    return BlockHeader(offset, channel, codec, flags, seq, first_ts, last_ts,
+                       record_count, raw_len, stored_len, payload_crc)
+
+
+def _resync(fp, start):
+    """Find the next header magic after a damaged region, or None at EOF."""
+    magics = (struct.pack("<I", FILE_MAGIC), struct.pack("<I", BLOCK_MAGIC))
+    pos = start
+    tail = b""
+    while True:
+        fp.seek(pos)
+        chunk = fp.read(65536)
+        if not chunk:
+            return None
+        buf = tail + chunk
+        hits = [i for i in (buf.find(m) for m in magics) if i >= 0]
+        if hits:
+            return pos - len(tail) + min(hits)
+        tail = buf[-3:]
+        pos += len(chunk)
+
+
+def scan(fp, start=0):
+    """Yield FileHeader, BlockHeader or Corruption entries, skipping payloads.
+
+    Only headers are read; payloads are seeked over, so listing a file costs
+    one small read per block.
+    """
+    offset = start
+    while True:
+        fp.seek(offset)
+        head = fp.read(4)
+        if len(head) < 4:
+            return
+
+        magic = struct.unpack("<I", head)[0]
+        try:
+            if magic == FILE_MAGIC:
+                raw = head + fp.read(FILE_HEADER.size - 4)
+                if len(raw) < FILE_HEADER.size:
+                    raise FormatError("truncated file header")
+                hdr = _parse_file_header(fp, offset, raw)
+                yield hdr
+                offset = fp.tell()
+                continue
+
+            if magic == BLOCK_MAGIC:
+                raw = head + fp.read(BLOCK_HEADER.size - 4)
+                if len(raw) < BLOCK_HEADER.size:
+                    raise FormatError("truncated block header")
+                hdr = _parse_block_header(offset, raw)
+                fp.seek(0, 2)
+                if hdr.end_offset > fp.tell():
+                    raise FormatError("truncated block payload")
+                yield hdr
+                offset = hdr.end_offset
+                continue
+
+            raise FormatError("bad magic 0x%08x" % magic)
+        except FormatError as err:
+            yield Corruption(offset, str(err))
+            offset = _resync(fp, offset + 1)
+            if offset is None:
+                return
+
+
+def read_payload(fp, block):
+    """Read, verify and decompress the payload of a block."""
+    fp.seek(block.payload_offset)
+    stored = fp.read(block.stored_len)
+    if len(stored) < block.stored_len:
+        raise FormatError("truncated block payload")
+    if zlib.crc32(stored) != block.payload_crc:
+        raise FormatError("payload CRC mismatch in block %d" % block.seq)
+
+    if block.codec == CODEC_NONE:
+        return stored
+    if block.codec == CODEC_LZ4:
+        return lz4.decompress(stored, block.raw_len)
+    raise FormatError("unknown codec %d" % block.codec)
+
+
+def parse_gap(payload):
+    """Decode the payload of a gap marker block."""
+    if len(payload) < GAP_RECORD.size:
+        raise FormatError("short gap record")
+    offline_us, online_us, dropped, _ = GAP_RECORD.unpack_from(payload)
+    return Gap(offline_us, online_us, dropped)
+
+
+def iter_records(block, payload):
+    """Yield (timestamp_us, channel, line) for every record in a decoded payload."""
+    if block.is_gap:
+        return
+    pos = 0
+    while pos + RECORD_HEADER.size <= len(payload):
+        delta, length = RECORD_HEADER.unpack_from(payload, pos)
+        pos += RECORD_HEADER.size
+        if block.is_tagged and length > 0:
+            yield block.first_ts_us + delta, payload[pos], payload[pos + 1:pos + length]
+        else:
+            yield block.first_ts_us + delta, block.channel, payload[pos:pos + length]
+        pos += length
@@ -0,0 +1,101 @@
+"""Sparse time index sidecars (.idx) written next to each segment."""
+
+import bisect
+import os
+import struct
+import zlib
+
+from . import container
+
+INDEX_MAGIC = 0x49474C53  # "SLGI"
+INDEX_ENTRY = struct.Struct("<IIqQII")
+
+assert INDEX_ENTRY.size == 32
+
+
+def index_path(segment_path):
+    return os.path.splitext(segment_path)[0] + ".idx"
+
+
+def load(path):
+    """Return [(ts_us, offset)] from an index file, dropping torn or corrupt entries."""
+    entries = []
+    try:
+        with open(path, "rb") as fp:
+            data = fp.read()
+    except FileNotFoundError:
+        return entries
+
+    for pos in range(0, len(data) - INDEX_ENTRY.size + 1, INDEX_ENTRY.size):
+        raw = data[pos:pos + INDEX_ENTRY.size]
+        magic, seq, ts_us, offset, crc, _ = INDEX_ENTRY.unpack(raw)
+        if magic != INDEX_MAGIC or zlib.crc32(raw[:24]) != crc:
+            continue
+        entries.append((ts_us, offset))
+    return entries
+
+
+def _monotonic_runs(entries):
+    """Split entries where the clock went backwards (e.g. a reboot before SNTP sync)."""
+    runs = []
+    start = 0
+    for idx in range(1, len(entries)):
+        if entries[idx][0] < entries[idx - 1][0]:
+            runs.append(entries[start:idx])
+            start = idx
+    if entries:
+        runs.append(entries[start:])
+    return runs
+
+
+def seek_offsets(entries, from_us):
+    """Offsets to start scanning at so every block at or after from_us is reached."""
+    offsets = []
+    for run in _monotonic_runs(entries):
+        keys = [ts for ts, _ in run]
+        pos = bisect.bisect_right(keys, from_us) - 1
+        offsets.append(run[max(pos, 0)][1])
+    return offsets
+
+
+def iter_window(path, from_us, to_us):
+    """Yield (ts_us, channel, line) for one segment inside [from_us, to_us], oldest first.
+
+    Timestamps can go backwards inside a segment (clock steps, lines stamped
+    late by the ingest path), so the window is collected and sorted before
+    anything is yielded: callers like heapq.merge rely on sorted input. Memory
+    is bounded by the window, not the segment. Equal timestamps keep file order.
+    """
+    records = list(_scan_window(path, from_us, to_us))
+    records.sort(key=lambda rec: rec[0])
+    return iter(records)
+
+
+def _scan_window(path, from_us, to_us):
+    """Records inside [from_us, to_us] in file order."""
+    entries = load(index_path(path))
+    starts = seek_offsets(entries, from_us) if entries else [0]
+
+    seen = set()
+    with open(path, "rb") as fp:
+        for start in starts:
+            for entry in container.scan(fp, start):
+                if not isinstance(entry, container.BlockHeader):
+                    continue
+                if entry.first_ts_us > to_us:
+                    break
+                if entry.offset in seen or entry.last_ts_us < from_us:
+                    continue
+                seen.add(entry.offset)
+
+                pos = fp.tell()
+                try:
+                    payload = container.read_payload(fp, entry)
+                except (container.FormatError, ValueError):
+                    fp.seek(pos)
+                    continue
+                fp.seek(pos)
+
+                for ts_us, channel, line in container.iter_records(entry, payload):
+                    if from_us <= ts_us <= to_us:
+                        yield ts_us, channel, line
@@ -0,0 +1,65 @@
+"""LZ4 block-format decoder matching main/lz4_codec.cpp."""
+
+
+class Lz4Error(ValueError):
+    pass
+
+
+def decompress(src: bytes, max_len: int) -> bytes:
+    out = bytearray()
+    ip = 0
+    end = len(src)
+
+    while ip < end:
+        token = src[ip]
+        ip += 1
+
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                if ip >= end:
+                    raise Lz4Error("truncated literal length")
+                b = src[ip]
+                ip += 1
+                lit_len += b
+                if b != 255:
+                    break
+
+        if ip + lit_len > end or len(out) + lit_len > max_len:
+            raise Lz4Error("literal run out of bounds")
+        out += src[ip:ip + lit_len]
+        ip += lit_len
+
+        if ip >= end:
+            break
+
+        if end - ip < 2:
+            raise Lz4Error("truncated match offset")
+        offset = src[ip] | (src[ip + 1] << 8)
+        ip += 2
+        if offset == 0 or offset > len(out):
+            raise Lz4Error("bad match offset")
+
+        match_len = token & 0x0f
+        if match_len == 15:
+            while True:
+                if ip >= end:
+                    raise Lz4Error("truncated match length")
+                b = src[ip]
+                ip += 1
+                match_len += b
+                if b != 255:
+                    break
+        match_len += 4
+
+        if len(out) + match_len > max_len:
+            raise Lz4Error("match out of bounds")
+
+        start = len(out) - offset
+        if offset >= match_len:
+            out += out[start:start + match_len]
+        else:
+            for idx in range(match_len):
+                out.append(out[start + idx])
+
+    return bytes(out)
@@ -0,0 +1,86 @@
+"""Offline k-way merge of several segments into one timeline, decoding blocks in parallel."""
+
+import collections
+import heapq
+import itertools
+import multiprocessing
+import os
+
+from . import container
+
+_files = {}
+
+# Blocks each worker may have decoded ahead of the merge, so a slow consumer doesn't pile up results
+_WINDOW_PER_WORKER = 4
+
+
+def _decode(job):
+    """Worker side: decode one block, returning its records as a list."""
+    path, block = job
+    fp = _files.get(path)
+    if fp is None:
+        fp = _files[path] = open(path, "rb")
+    try:
+        payload = container.read_payload(fp, block)
+    except (container.FormatError, ValueError) as err:
+        return block, None, str(err)
+    if block.is_gap:
+        return block, container.parse_gap(payload), None
+    return block, list(container.iter_records(block, payload)), None
+
+
+def _blocks(paths):
+    """All blocks of all inputs, oldest first. Only headers are read here."""
+    jobs = []
+    for path in paths:
+        with open(path, "rb") as fp:
+            for entry in container.scan(fp):
+                if isinstance(entry, container.BlockHeader):
+                    jobs.append((path, entry))
+    jobs.sort(key=lambda job: job[1].first_ts_us)
+    return jobs
+
+
+def _decoded(pool, blocks, window):
+    """Decode results in block order, with at most window blocks submitted but not yet consumed."""
+    pending = collections.deque()
+    for block in blocks:
+        pending.append(pool.apply_async(_decode, (block,)))
+        if len(pending) >= window:
+            yield pending.popleft().get()
+    while pending:
+        yield pending.popleft().get()
+
+
+def merge(paths, jobs=None, on_error=None, on_gap=None):
+    """Yield (ts_us, channel, line) across all segments in timestamp order.
+
+    Blocks are decoded by a process pool in order of their first timestamp. A
+    record can be emitted once it's older than the next block's first timestamp,
+    since nothing decoded later can precede it. Workers only run a few blocks
+    ahead of the merge, so memory is bounded by that window plus how much the
+    inputs overlap, not by their size; the list of block headers is the
+    exception, it's read up front. Ties go to the lower channel, same as on the
+    device.
+    """
+    blocks = _blocks(paths)
+    heap = []
+    tiebreak = itertools.count()
+    window = (jobs or os.cpu_count() or 1) * _WINDOW_PER_WORKER
+    with multiprocessing.Pool(jobs) as pool:
+        results = _decoded(pool, blocks, window)
+        for idx, (block, records, err) in enumerate(results):
+            if err is not None:
+                if on_error:
+                    on_error(blocks[idx][0], block, err)
+            elif block.is_gap:
+                if on_gap:
+                    on_gap(blocks[idx][0], block, records)
+            else:
+                for ts_us, channel, line in records:
+                    heapq.heappush(heap, (ts_us, channel, next(tiebreak), line))
+
+            limit = blocks[idx + 1][1].first_ts_us if idx + 1 < len(blocks) else None
+            while heap and (limit is None or heap[0][0] < limit):
+                ts_us, channel, _, line = heapq.heappop(heap)
+                yield ts_us, channel, line
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Inspect and decode soullogger segment files on the host."""
+
+import argparse
+import datetime
+import heapq
+import sys
+
+from slg import container, index, merge
+
+
+def format_ts(ts_us):
+    return "[%d%06d] " % (ts_us // 1000000, ts_us % 1000000)
+
+
+def cmd_info(args):
+    blocks = 0
+    corrupt = 0
+    first_ts = None
+    last_ts = None
+    with open(args.input, "rb") as fp:
+        for entry in container.scan(fp):
+            if isinstance(entry, container.FileHeader):
+                print("@%d segment: channel=%d boot=0x%08x fw=%s created=%d config=%dB" % (
+                    entry.offset, entry.channel, entry.boot_id, entry.fw_version,
+                    entry.created_us, len(entry.config)))
+            elif isinstance(entry, container.BlockHeader):
+                blocks += 1
+                first_ts = entry.first_ts_us if first_ts is None else min(first_ts, entry.first_ts_us)
+                last_ts = entry.last_ts_us if last_ts is None else max(last_ts, entry.last_ts_us)
+            else:
+                corrupt += 1
+                print("@%d corrupt: %s" % (entry.offset, entry.reason))
+
+    print("%d blocks, %d corrupt regions, time %s .. %s" % (blocks, corrupt, first_ts, last_ts))
+
+
+def cmd_blocks(args):
+    with open(args.input, "rb") as fp:
+        for entry in container.scan(fp):
+            if isinstance(entry, container.BlockHeader):
+                print("@%d ch=%d seq=%d codec=%s records=%d raw=%d stored=%d ts=%d..%d%s" % (
+                    entry.offset, entry.channel, entry.seq,
+                    container.CODEC_NAMES.get(entry.codec, str(entry.codec)), entry.record_count,
+                    entry.raw_len, entry.stored_len, entry.first_ts_us, entry.last_ts_us,
+                    " gap" if entry.is_gap else " tagged" if entry.is_tagged else ""))
+            elif isinstance(entry, container.Corruption):
+                print("@%d corrupt: %s" % (entry.offset, entry.reason))
+
+
+def cmd_cat(args):
+    out = open(args.output, "wb") if args.output else sys.stdout.buffer
+    with open(args.input, "rb") as fp:
+        for entry in list(container.scan(fp)):
+            if not isinstance(entry, container.BlockHeader):
+                continue
+            try:
+                payload = container.read_payload(fp, entry)
+            except (container.FormatError, ValueError) as err:
+                sys.stderr.write("@%d skipped: %s\n" % (entry.offset, err))
+                continue
+            if entry.is_gap:
+                gap = container.parse_gap(payload)
+                sys.stderr.write("@%d gap: card offline %.3f s, %d line(s) dropped\n" % (
+                    entry.offset, (gap.online_us - gap.offline_us) / 1e6, gap.dropped_lines))
+                continue
+            for ts_us, channel, line in container.iter_records(entry, payload):
+                if not args.no_ts:
+                    out.write(format_ts(ts_us).encode())
+                if entry.is_tagged:
+                    out.write(b"uart%d: " % channel)
+                out.write(line.hex(" ").encode() + b"\n" if args.hex else line)
+    out.flush()
+
+
+def cmd_config(args):
+    with open(args.input, "rb") as fp:
+        for entry in container.scan(fp):
+            if isinstance(entry, container.FileHeader):
+                sys.stdout.write(entry.config.decode(errors="replace") + "\n")
+
+
+def cmd_verify(args):
+    errors = 0
+    with open(args.input, "rb") as fp:
+        for entry in list(container.scan(fp)):
+            if isinstance(entry, container.Corruption):
+                errors += 1
+                print("@%d corrupt: %s" % (entry.offset, entry.reason))
+            elif isinstance(entry, container.BlockHeader):
+                try:
+                    container.read_payload(fp, entry)
+                except (container.FormatError, ValueError) as err:
+                    errors += 1
+                    print("@%d %s" % (entry.offset, err))
+
+    print("OK" if errors == 0 else "%d errors" % errors)
+    return 0 if errors == 0 else 1
+
+
+def parse_time(text):
+    """Epoch seconds, or an ISO date/time in local time (e.g. 2026-10-19T14:03:22)."""
+    try:
+        return int(float(text) * 1000000)
+    except ValueError:
+        return int(datetime.datetime.fromisoformat(text).timestamp() * 1000000)
+
+
+def cmd_query(args):
+    from_us = parse_time(args.start)
+    to_us = parse_time(args.end)
+    streams = [index.iter_window(path, from_us, to_us) for path in args.inputs]
+
+    out = sys.stdout.buffer
+    for ts_us, channel, line in heapq.merge(*streams, key=lambda rec: rec[0]):
+        out.write(format_ts(ts_us).encode() + b"uart%d: " % channel + line)
+    out.flush()
+
+
+def cmd_merge(args):
+    def on_error(path, block, err):
+        sys.stderr.write("%s@%d skipped: %s\n" % (path, block.offset, err))
+
+    def on_gap(path, block, gap):
+        sys.stderr.write("%s@%d gap: card offline %.3f s, %d line(s) dropped\n" % (
+            path, block.offset, (gap.online_us - gap.offline_us) / 1e6, gap.dropped_lines))
+
+    out = open(args.output, "wb") if args.output else sys.stdout.buffer
+    for ts_us, channel, line in merge.merge(args.inputs, args.jobs, on_error, on_gap):
+        out.write(format_ts(ts_us).encode() + b"uart%d: " % channel + line)
+    out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("info", help="Summarise segment headers and time range")
+    p.add_argument("input")
+    p.set_defaults(func=cmd_info)
+
+    p = sub.add_parser("blocks", help="List block headers without decoding payloads")
+    p.add_argument("input")
+    p.set_defaults(func=cmd_blocks)
+
+    p = sub.add_parser("cat", help="Decode lines as text")
+    p.add_argument("input")
+    p.add_argument("-o", "--output")
+    p.add_argument("--no-ts", action="store_true", help="Don't prefix lines with capture time")
+    p.add_argument("--hex", action="store_true", help="One hex dump per record, for sniffer byte runs")
+    p.set_defaults(func=cmd_cat)
+
+    p = sub.add_parser("config", help="Print the config snapshot(s) stored in a segment")
+    p.add_argument("input")
+    p.set_defaults(func=cmd_config)
+
+    p = sub.add_parser("verify", help="Check every header and payload CRC")
+    p.add_argument("input")
+    p.set_defaults(func=cmd_verify)
+
+    p = sub.add_parser("query", help="Pull a time window out of one or more segments using their .idx")
+    p.add_argument("--from", dest="start", required=True, help="Epoch seconds or ISO time")
+    p.add_argument("--to", dest="end", required=True, help="Epoch seconds or ISO time")
+    p.add_argument("inputs", nargs="+")
+    p.set_defaults(func=cmd_query)
+
+    p = sub.add_parser("merge", help="Interleave whole segments by capture time, decoding in parallel")
+    p.add_argument("-j", "--jobs", type=int, help="Decoder processes (default: one per CPU)")
+    p.add_argument("-o", "--output")
+    p.add_argument("inputs", nargs="+")
+    p.set_defaults(func=cmd_merge)
+
+    args = parser.parse_args()
+    sys.exit(args.func(args) or 0)
+
+
+if __name__ == "__main__":
+    main()